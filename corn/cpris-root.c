@@ -2,11 +2,14 @@
 //
 // AKA stuff that should be in MPRIS but isn't yet
 
+#include "gettext.h"
 #include "main.h"
 #include "playlist.h"
+#include "db.h"
 
 #include "cpris-root.h"
 
+#include <dbus/dbus-glib.h>
 #include <glib.h>
 #include <glib-object.h>
 
@@ -16,11 +19,64 @@ static void cpris_root_init(CprisRoot * obj)
 {
 }
 
+guint scan_progress_signal;
+guint scan_finished_signal;
+
 static void cpris_root_class_init(CprisRootClass * klass)
 {
+    scan_progress_signal =
+        g_signal_new("scan_progress",
+                     G_OBJECT_CLASS_TYPE(klass),
+                     G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_marshal_VOID__INT,
+                     G_TYPE_NONE, 1, G_TYPE_INT);
+    scan_finished_signal =
+        g_signal_new("scan_finished",
+                     G_OBJECT_CLASS_TYPE(klass),
+                     G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_marshal_VOID__INT,
+                     G_TYPE_NONE, 1, G_TYPE_INT);
+}
+
+// one reply carrying the metadata for a whole stretch of the playlist, so
+// that frontends don't have to make a GetMetadata round trip per track.
+// these are async so the shared tables from the db can be marshalled
+// directly and released afterwards.
+static void return_metadata_range(DBusGMethodInvocation * context, gint start, gint count)
+{
+    start = CLAMP(start, 0, playlist_length());
+    count = CLAMP(count, 0, playlist_length() - start);
+
+    const gchar ** uris = g_new(const gchar *, count);
+    for(gint i = 0; i < count; i++)
+        uris[i] = playlist_nth(start + i);
+
+    GPtrArray * metas = db_get_many(uris, count);
+    g_free(uris);
+
+    dbus_g_method_return(context, metas);
+
+    for(guint i = 0; i < metas->len; i++)
+        g_hash_table_unref(g_ptr_array_index(metas, i));
+    g_ptr_array_free(metas, TRUE);
+}
+
+gboolean cpris_root_get_all_metadata(CprisRoot * obj, DBusGMethodInvocation * context)
+{
+    return_metadata_range(context, 0, playlist_length());
+    return TRUE;
 }
 
-// TODO: GetAllMetadata
+gboolean cpris_root_get_metadata_range(CprisRoot * obj, gint start, gint count,
+                                       DBusGMethodInvocation * context)
+{
+    return_metadata_range(context, start, count);
+    return TRUE;
+}
 
 gboolean cpris_root_clear(CprisRoot * obj, GError ** error)
 {
@@ -41,3 +97,53 @@ gboolean cpris_root_move(CprisRoot * obj, gint from, gint to, GError ** error)
     playlist_move(to, from);
     return TRUE;
 }
+
+// the batch versions of AddTrack, DelTrack and Move, for frontends working on
+// a whole selection.  each is applied in one go and announced with a single
+// TrackListChange, instead of one round trip and signal per track.
+
+gboolean cpris_root_add_tracks(CprisRoot * obj, const gchar ** uris, GError ** error)
+{
+    guint n = uris ? g_strv_length((gchar **)uris) : 0;
+    gchar ** paths = g_new0(gchar *, n + 1);
+    guint npaths = 0;
+
+    for(guint i = 0; i < n; i++)
+    {
+        gchar * u = g_filename_to_utf8(uris[i], -1, NULL, NULL, NULL);
+        if(u)
+            paths[npaths++] = u;
+        else
+            g_warning(_("Skipping '%s'. Could not convert to UTF-8. "
+                        "See the README for a possible solution."), uris[i]);
+    }
+
+    if(npaths)
+        playlist_append_many_async(paths);
+    else
+        g_strfreev(paths);
+    return TRUE;
+}
+
+gboolean cpris_root_del_tracks(CprisRoot * obj, GArray * tracks, GError ** error)
+{
+    playlist_remove_many((const gint *)tracks->data, tracks->len);
+    return TRUE;
+}
+
+gboolean cpris_root_move_range(CprisRoot * obj, gint start, gint count, gint dest,
+                               GError ** error)
+{
+    playlist_move_range(start, count, dest);
+    return TRUE;
+}
+
+void cpris_root_emit_scan_progress(CprisRoot * obj, gint found)
+{
+    g_signal_emit(obj, scan_progress_signal, 0, found);
+}
+
+void cpris_root_emit_scan_finished(CprisRoot * obj, gint found)
+{
+    g_signal_emit(obj, scan_finished_signal, 0, found);
+}
@@ -5,6 +5,7 @@
 #ifndef __corn_cpris_root_h__
 #define __corn_cpris_root_h__
 
+#include <dbus/dbus-glib.h>
 #include <glib-object.h>
 
 typedef struct _CprisRoot { GObject parent; } CprisRoot;
@@ -12,8 +13,18 @@ typedef struct _CprisRootClass { GObjectClass parent; } CprisRootClass;
 
 GType cpris_root_get_type(void);
 
+gboolean cpris_root_get_all_metadata(CprisRoot * obj, DBusGMethodInvocation * context);
+gboolean cpris_root_get_metadata_range(CprisRoot * obj, gint start, gint count,
+                                       DBusGMethodInvocation * context);
 gboolean cpris_root_clear(CprisRoot * obj, GError ** error);
 gboolean cpris_root_play_track(CprisRoot * obj, gint track, GError ** error);
 gboolean cpris_root_move(CprisRoot * obj, gint from, gint to, GError ** error);
+gboolean cpris_root_add_tracks(CprisRoot * obj, const gchar ** uris, GError ** error);
+gboolean cpris_root_del_tracks(CprisRoot * obj, GArray * tracks, GError ** error);
+gboolean cpris_root_move_range(CprisRoot * obj, gint start, gint count, gint dest,
+                               GError ** error);
+
+void cpris_root_emit_scan_progress(CprisRoot * obj, gint found);
+void cpris_root_emit_scan_finished(CprisRoot * obj, gint found);
 
 #endif
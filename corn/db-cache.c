@@ -0,0 +1,98 @@
+#include "config.h"
+
+#include "db-cache.h"
+#include "uri-intern.h"
+
+#include <glib.h>
+
+// a size-bounded LRU of metadata tables, keyed by uri.  the tables are shared:
+// lookups hand out a new reference, and nobody is allowed to modify one once
+// it's in here.
+//
+// `lru' holds the entries most recently used first; `by_uri' maps a uri to its
+// link in `lru' so that a hit can be moved to the front in O(1).
+
+#define db_cache_size 4096
+
+typedef struct
+{
+    const gchar * uri; // interned
+    GHashTable * meta;
+} CacheEntry;
+
+static GQueue lru = G_QUEUE_INIT;
+static GHashTable * by_uri = NULL;
+
+static guint hits = 0;
+static guint misses = 0;
+
+static void entry_free(CacheEntry * entry)
+{
+    uri_unref(entry->uri);
+    g_hash_table_unref(entry->meta);
+    g_free(entry);
+}
+
+static void unlink_and_free(GList * link)
+{
+    g_queue_unlink(&lru, link);
+    g_hash_table_remove(by_uri, ((CacheEntry *)link->data)->uri);
+    entry_free((CacheEntry *)link->data);
+    g_list_free_1(link);
+}
+
+void db_cache_init(void)
+{
+    // keys belong to the entries
+    by_uri = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+void db_cache_destroy(void)
+{
+    GList * link;
+    while((link = g_queue_peek_tail_link(&lru)))
+        unlink_and_free(link);
+
+    g_hash_table_unref(by_uri);
+    by_uri = NULL;
+
+    g_debug("Metadata cache: %u hits, %u misses.", hits, misses);
+}
+
+GHashTable * db_cache_lookup(const gchar * uri)
+{
+    GList * link = g_hash_table_lookup(by_uri, uri);
+    if(!link)
+    {
+        misses++;
+        return NULL;
+    }
+
+    hits++;
+    g_queue_unlink(&lru, link);
+    g_queue_push_head_link(&lru, link);
+    return g_hash_table_ref(((CacheEntry *)link->data)->meta);
+}
+
+// takes a new reference to meta
+void db_cache_insert(const gchar * uri, GHashTable * meta)
+{
+    db_cache_invalidate(uri);
+
+    CacheEntry * entry = g_new(CacheEntry, 1);
+    entry->uri = uri_intern(uri);
+    entry->meta = g_hash_table_ref(meta);
+
+    g_queue_push_head(&lru, entry);
+    g_hash_table_insert(by_uri, (gpointer)entry->uri, g_queue_peek_head_link(&lru));
+
+    while(g_queue_get_length(&lru) > db_cache_size)
+        unlink_and_free(g_queue_peek_tail_link(&lru));
+}
+
+void db_cache_invalidate(const gchar * uri)
+{
+    GList * link;
+    if(by_uri && (link = g_hash_table_lookup(by_uri, uri)))
+        unlink_and_free(link);
+}
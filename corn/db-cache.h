@@ -0,0 +1,13 @@
+#ifndef __corn_db_cache_h__
+#define __corn_db_cache_h__
+
+#include <glib.h>
+
+void db_cache_init(void);
+void db_cache_destroy(void);
+
+GHashTable * db_cache_lookup(const gchar * uri);
+void db_cache_insert(const gchar * uri, GHashTable * meta);
+void db_cache_invalidate(const gchar * uri);
+
+#endif
@@ -1,27 +1,92 @@
 #include "config.h"
 
 #include "db.h"
+#include "db-cache.h"
 #include "main.h"
 #include "music-metadata.h"
+#include "mpris-player.h"
+#include "playlist.h"
+#include "uri-intern.h"
 
 #include <sqlite3.h>
 
 #include <glib-object.h>
 #include <glib.h>
+#include <sys/stat.h>
 
 static sqlite3 * db = NULL;
 
 static GHashTable * to_update = NULL;
-static GHashTable * to_remove = NULL;
+
+// writes are batched: finished rows and removals collect in `pending'
+// (uri -> metadata, or NULL for a removal) and are written in a single
+// transaction once db_batch_rows of them have piled up, or db_batch_ms after
+// the first one arrived, whichever comes first.
+#define db_batch_rows 2000
+#define db_batch_ms 500
+
+// sqlite won't bind more than 999 parameters to a statement
+#define db_max_bound_uris 500
+
+static GHashTable * pending = NULL; // of DbRow
+static guint flush_timeout = 0;
+
+// a FileStat is enough to tell whether a file has changed since it was last
+// probed.  all zero means unknown, which never matches.
+typedef struct
+{
+    GHashTable * meta;
+    FileStat print;
+} DbRow;
+
+// metadata extraction is done by a fixed set of worker threads, each owning
+// its own probe stream.  uris go out through `tasks', finished rows come back
+// through `results' and are inserted by the main loop.  sqlite is only ever
+// touched from the main thread.
+#define db_worker_count 4
+#define db_max_in_flight (db_worker_count * 8)
+
+// the main thread fills in `known' from the db, and the worker only probes if
+// the file's current fingerprint differs from it.  if whoever scheduled the
+// update already had the current fingerprint, it's in `print' and the worker
+// doesn't stat the file again.
+typedef struct
+{
+    const gchar * uri; // interned
+    guint generation;
+    FileStat known;
+    FileStat print;
+    gboolean have_print;
+    GHashTable * meta; // NULL if the file hasn't changed
+} DbTask;
+
+static GThread * workers[db_worker_count];
+static MusicProbe * probes[db_worker_count];
+static GAsyncQueue * tasks = NULL;
+static GAsyncQueue * results = NULL;
+
+// uri -> generation of the most recently dispatched task for that uri.  a
+// result is only written if it is still the latest one and the uri hasn't
+// been scheduled for removal in the meantime.
+static GHashTable * in_flight = NULL;
+static guint generation = 0;
+static gint outstanding = 0;
+static gint drain_pending = 0;
+static guint nprobed = 0;
+static guint nunchanged = 0;
+
+// pushed once per worker to make it exit
+static DbTask stop_task;
 
 static sqlite3_stmt * insert_stmt;
 static sqlite3_stmt * delete_stmt;
 static sqlite3_stmt * select_stmt;
+static sqlite3_stmt * fingerprint_stmt;
 static sqlite3_stmt * begin_stmt;
 static sqlite3_stmt * commit_stmt;
 
-gboolean need_commit = FALSE;
-
+// the original schema.  new dbs are created with it too and then brought up
+// to date by the same migrations as old ones, so there's only one path.
 static const char * sql_create_table =
     "create table if not exists metadata ("
     "    location text not null primary key,"
@@ -34,10 +99,36 @@ static const char * sql_create_table =
     "    bitrate int"
     ")";
 
+// migrations[n] takes the schema from version n to n+1.  the version lives in
+// sqlite's user_version.
+static const char * migrations[] = {
+    // "mtime" was always the track length in ms (the mpris name for it); call
+    // it that, and add the file's fingerprint.  sqlite can't rename columns,
+    // so copy the table.
+    "create table metadata_new ("
+    "    location text not null primary key,"
+    "    artist text,"
+    "    title text,"
+    "    album text,"
+    "    tracknumber text,"
+    "    length int,"
+    "    samplerate int,"
+    "    bitrate int,"
+    "    file_size int,"
+    "    file_mtime int,"
+    "    file_inode int"
+    ");"
+    "insert into metadata_new (location, artist, title, album, tracknumber, length, samplerate, bitrate)"
+    "    select location, artist, title, album, tracknumber, mtime, samplerate, bitrate from metadata;"
+    "drop table metadata;"
+    "alter table metadata_new rename to metadata;",
+};
+
 static const char * sql_item_insert =
     "insert or replace into metadata ("
-    "    location, artist, title, album, tracknumber, mtime, samplerate, bitrate"
-    ") values (?, ?, ?, ?, ?, ?, ?, ?)";
+    "    location, artist, title, album, tracknumber, length, samplerate, bitrate,"
+    "    file_size, file_mtime, file_inode"
+    ") values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
 
 static const char * sql_item_delete =
     "delete from metadata where location = ?";
@@ -45,6 +136,9 @@ static const char * sql_item_delete =
 static const char * sql_item_select =
     "select * from metadata where location = ?";
 
+static const char * sql_fingerprint_select =
+    "select file_size, file_mtime, file_inode from metadata where location = ?";
+
 static void printerr(gint loglevel, const char * func, const char * msg)
 {
     g_log(G_LOG_DOMAIN, loglevel, "DB Error in function %s(): %s (%s).",
@@ -74,17 +168,164 @@ static void printerr(gint loglevel, const char * func, const char * msg)
 #define db_warn_if_fail(code, errmsg) \
     _db_try(G_LOG_LEVEL_WARNING, code, errmsg, break) 
 
-static gboolean periodic_commit(G_GNUC_UNUSED gpointer data)
+static void meta_free(gpointer meta)
+{
+    if(meta)
+        g_hash_table_unref((GHashTable *)meta);
+}
+
+static void pending_free(gpointer data)
 {
-    if(need_commit)
+    DbRow * row = (DbRow *)data;
+    if(row)
     {
-        retry(sqlite3_reset(commit_stmt));
-        retry(sqlite3_reset(begin_stmt));
-        retry(sqlite3_step(commit_stmt));
-        retry(sqlite3_step(begin_stmt));
-        need_commit = FALSE;
+        g_hash_table_unref(row->meta);
+        g_free(row);
     }
-    return TRUE;
+}
+
+static void task_free(DbTask * task)
+{
+    uri_unref(task->uri);
+    if(task->meta)
+        g_hash_table_unref(task->meta);
+    g_free(task);
+}
+
+static gboolean drain_results(gpointer data);
+static void flush_writes(void);
+
+static gboolean fingerprint_file(const gchar * uri, FileStat * print)
+{
+    gchar * filename = g_filename_from_uri(uri, NULL, NULL);
+    if(!filename)
+        return FALSE; // not a local file; nothing cheap to go by
+
+    struct stat st;
+    gboolean ok = !stat(filename, &st);
+    g_free(filename);
+    if(ok)
+    {
+        print->size = st.st_size;
+        print->mtime = st.st_mtime;
+        print->inode = st.st_ino;
+    }
+    return ok;
+}
+
+static inline gboolean fingerprint_equal(const FileStat * a, const FileStat * b)
+{
+    return a->size == b->size && a->mtime == b->mtime && a->inode == b->inode;
+}
+
+static gpointer worker_threadfunc(gpointer data)
+{
+    MusicProbe * probe = (MusicProbe *)data;
+    DbTask * task;
+
+    while((task = g_async_queue_pop(tasks)) != &stop_task)
+    {
+        // an unknown fingerprint is all zero, which no real file has, so it
+        // never matches
+        if(!task->have_print)
+            task->have_print = fingerprint_file(task->uri, &task->print);
+        if(!task->have_print || !fingerprint_equal(&task->print, &task->known))
+            task->meta = music_probe_get_metadata(probe, task->uri);
+        g_async_queue_push(results, task);
+
+        // one wakeup per burst of results, not one per result
+        if(g_atomic_int_compare_and_exchange(&drain_pending, 0, 1))
+            g_idle_add_full(G_PRIORITY_LOW, drain_results, NULL, NULL);
+    }
+    return NULL;
+}
+
+static void stop_workers(void)
+{
+    for(gint i = 0; i < db_worker_count; i++)
+        if(workers[i])
+            g_async_queue_push(tasks, &stop_task);
+
+    for(gint i = 0; i < db_worker_count; i++)
+    {
+        if(workers[i])
+            g_thread_join(workers[i]);
+        music_probe_free(probes[i]);
+        workers[i] = NULL;
+        probes[i] = NULL;
+    }
+
+    DbTask * task;
+    while((task = g_async_queue_try_pop(tasks)))
+        task_free(task);
+    while((task = g_async_queue_try_pop(results)))
+        task_free(task);
+
+    g_async_queue_unref(tasks);
+    g_async_queue_unref(results);
+    tasks = results = NULL;
+}
+
+static gint start_workers(void)
+{
+    tasks = g_async_queue_new();
+    results = g_async_queue_new();
+
+    for(gint i = 0; i < db_worker_count; i++)
+    {
+        GError * error = NULL;
+        if(!(probes[i] = music_probe_new()) ||
+           !(workers[i] = g_thread_create(worker_threadfunc, probes[i], TRUE, &error)))
+        {
+            g_critical("Couldn't start metadata worker thread (%s).",
+                    error ? error->message : "no probe stream");
+            if(error)
+                g_error_free(error);
+            // take down the ones that did start
+            stop_workers();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static gint migrate(void)
+{
+    sqlite3_stmt * stmt;
+    gint version = 0;
+    if(sqlite3_prepare_v2(db, "pragma user_version", -1, &stmt, NULL) == SQLITE_OK)
+    {
+        if(sqlite3_step(stmt) == SQLITE_ROW)
+            version = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+
+    gint latest = G_N_ELEMENTS(migrations);
+    if(version > latest)
+    {
+        g_critical("Metadata db is from a newer version (schema %d, we know up to %d).",
+                version, latest);
+        return 1;
+    }
+
+    for(; version < latest; version++)
+    {
+        gchar * bump = g_strdup_printf("pragma user_version = %d", version + 1);
+        gboolean ok =
+            sqlite3_exec(db, "begin", NULL, NULL, NULL) == SQLITE_OK &&
+            sqlite3_exec(db, migrations[version], NULL, NULL, NULL) == SQLITE_OK &&
+            sqlite3_exec(db, bump, NULL, NULL, NULL) == SQLITE_OK &&
+            sqlite3_exec(db, "commit", NULL, NULL, NULL) == SQLITE_OK;
+        g_free(bump);
+
+        if(!ok)
+        {
+            printerr(G_LOG_LEVEL_CRITICAL, __func__, "Couldn't migrate metadata db");
+            sqlite3_exec(db, "rollback", NULL, NULL, NULL);
+            return 1;
+        }
+    }
+    return 0;
 }
 
 gint db_init(void)
@@ -100,6 +341,16 @@ gint db_init(void)
 
     sqlite3_stmt * create_stmt;
 
+    // the db is only a cache of tags, so trading a little durability for
+    // much cheaper commits is fine
+    db_init_return_if_fail(
+        sqlite3_exec(db, "pragma journal_mode = wal", NULL, NULL, NULL),
+        "Couldn't set journal mode");
+
+    db_init_return_if_fail(
+        sqlite3_exec(db, "pragma synchronous = normal", NULL, NULL, NULL),
+        "Couldn't set synchronous mode");
+
     db_init_return_if_fail(
         sqlite3_prepare_v2(db, sql_create_table, -1, &create_stmt, NULL),
         "Couldn't prepare create stmt");
@@ -112,6 +363,9 @@ gint db_init(void)
         sqlite3_finalize(create_stmt),
         "Couldn't finalize create stmt");
 
+    if(migrate())
+        return 42;
+
     db_init_return_if_fail(
         sqlite3_prepare_v2(db, sql_item_insert, -1, &insert_stmt, NULL),
         "Couldn't prepare insert stmt");
@@ -124,6 +378,10 @@ gint db_init(void)
         sqlite3_prepare_v2(db, sql_item_select, -1, &select_stmt, NULL),
         "Couldn't prepare select stmt");
 
+    db_init_return_if_fail(
+        sqlite3_prepare_v2(db, sql_fingerprint_select, -1, &fingerprint_stmt, NULL),
+        "Couldn't prepare fingerprint stmt");
+
     db_init_return_if_fail(
         sqlite3_prepare_v2(db, "begin",  -1, &begin_stmt,  NULL),
         "Couldn't prepare begin stmt");
@@ -132,26 +390,31 @@ gint db_init(void)
         sqlite3_prepare_v2(db, "commit", -1, &commit_stmt, NULL),
         "Couldn't prepare commit stmt");
 
-    db_init_return_if_fail(
-        sqlite3_step(begin_stmt),
-        "Couldn't begin transaction");
+    // keys are interned uris
+    // uri -> the FileStat it was found with, or NULL
+    to_update = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)uri_unref, g_free);
+    pending = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)uri_unref, pending_free);
+    in_flight = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)uri_unref, NULL);
 
-    to_update = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-    to_remove = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    db_cache_init();
 
-    g_timeout_add_seconds_full(G_PRIORITY_DEFAULT, 10, periodic_commit, NULL, NULL);
+    if(start_workers())
+        return 41;
 
     return 0;
 }
 
 void db_destroy(void)
 {
-    db_warn_if_fail(sqlite3_reset(commit_stmt), "Couldn't reset commit stmt");
-    db_warn_if_fail(sqlite3_step(commit_stmt),  "Couldn't step commit stmt");
+    stop_workers();
+    flush_writes();
+
+    g_debug("Metadata updates: %u files probed, %u found unchanged.", nprobed, nunchanged);
 
     db_warn_if_fail(sqlite3_finalize(insert_stmt), "Couldn't finalize insert stmt");
     db_warn_if_fail(sqlite3_finalize(delete_stmt), "Couldn't finalize delete stmt");
     db_warn_if_fail(sqlite3_finalize(select_stmt), "Couldn't finalize select stmt");
+    db_warn_if_fail(sqlite3_finalize(fingerprint_stmt), "Couldn't finalize fingerprint stmt");
     db_warn_if_fail(sqlite3_finalize(begin_stmt),  "Couldn't finalize begin stmt");
     db_warn_if_fail(sqlite3_finalize(commit_stmt), "Couldn't finalize commit stmt");
 
@@ -159,13 +422,17 @@ void db_destroy(void)
         sqlite3_close(db);
 
     g_hash_table_unref(to_update);
-    g_hash_table_unref(to_remove);
+    g_hash_table_unref(pending);
+    g_hash_table_unref(in_flight);
+
+    db_cache_destroy();
 }
 
 // CRUD
 
-static void update_with_metadata(const gchar * uri, GHashTable * meta)
+static void update_with_metadata(const gchar * uri, DbRow * row)
 {
+    GHashTable * meta = row->meta;
     sqlite3_reset(insert_stmt);
     sqlite3_clear_bindings(insert_stmt);
 
@@ -174,7 +441,7 @@ static void update_with_metadata(const gchar * uri, GHashTable * meta)
     GValue * title       = g_hash_table_lookup(meta, "title");
     GValue * album       = g_hash_table_lookup(meta, "album");
     GValue * tracknumber = g_hash_table_lookup(meta, "tracknumber");
-    GValue * mtime       = g_hash_table_lookup(meta, "mtime");
+    GValue * length      = g_hash_table_lookup(meta, "mtime");
     GValue * samplerate  = g_hash_table_lookup(meta, "audio-samplerate");
     GValue * bitrate     = g_hash_table_lookup(meta, "audio-bitrate");
 
@@ -183,16 +450,165 @@ static void update_with_metadata(const gchar * uri, GHashTable * meta)
     if(title)       sqlite3_bind_text(insert_stmt, 3, g_value_get_string(title),       -1, SQLITE_STATIC);
     if(album)       sqlite3_bind_text(insert_stmt, 4, g_value_get_string(album),       -1, SQLITE_STATIC);
     if(tracknumber) sqlite3_bind_text(insert_stmt, 5, g_value_get_string(tracknumber), -1, SQLITE_STATIC);
-    if(mtime)       sqlite3_bind_int (insert_stmt, 6, g_value_get_int(mtime));
+    if(length)      sqlite3_bind_int (insert_stmt, 6, g_value_get_int(length));
     if(samplerate)  sqlite3_bind_int (insert_stmt, 7, g_value_get_int(samplerate));
     if(bitrate)     sqlite3_bind_int (insert_stmt, 8, g_value_get_int(bitrate));
 
+    if(row->print.inode)
+    {
+        sqlite3_bind_int64(insert_stmt,  9, row->print.size);
+        sqlite3_bind_int64(insert_stmt, 10, row->print.mtime);
+        sqlite3_bind_int64(insert_stmt, 11, row->print.inode);
+    }
+
     db_return_if_fail(sqlite3_step(insert_stmt), "Couldn't step insert stmt");
-    need_commit = TRUE;
 }
 
-static GHashTable * get(const gchar * uri, gboolean autoadd)
+static void remove(const gchar * uri)
+{
+    sqlite3_reset(delete_stmt);
+    sqlite3_bind_text(delete_stmt, 1, uri, -1, SQLITE_STATIC);
+    db_return_if_fail(sqlite3_step(delete_stmt), "Couldn't step delete stmt");
+}
+
+// write batching
+
+static void flush_writes(void)
 {
+    if(flush_timeout)
+    {
+        g_source_remove(flush_timeout);
+        flush_timeout = 0;
+    }
+
+    if(!db || !g_hash_table_size(pending))
+        return;
+
+    retry(sqlite3_reset(begin_stmt));
+    retry(sqlite3_step(begin_stmt));
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, pending);
+    while(db && g_hash_table_iter_next(&iter, &key, &value))
+    {
+        if(value)
+            update_with_metadata((const gchar *)key, (DbRow *)value);
+        else
+            remove((const gchar *)key);
+    }
+
+    if(db)
+    {
+        retry(sqlite3_reset(commit_stmt));
+        retry(sqlite3_step(commit_stmt));
+    }
+
+    g_hash_table_remove_all(pending);
+}
+
+static gboolean flush_when_due(G_GNUC_UNUSED gpointer data)
+{
+    flush_timeout = 0;
+    flush_writes();
+    return FALSE;
+}
+
+// takes ownership of meta, which is NULL for a removal.  a later write for
+// the same uri replaces an earlier one that hasn't been flushed yet.
+static void queue_write(const gchar * uri, GHashTable * meta, const FileStat * print)
+{
+    DbRow * row = NULL;
+    if(meta)
+    {
+        row = g_new0(DbRow, 1);
+        row->meta = meta;
+        if(print)
+            row->print = *print;
+    }
+
+    db_cache_invalidate(uri);
+    // mpris keeps its own copy of the current track's metadata
+    if(playlist_position() > -1 && g_str_equal(uri, playlist_current()))
+        mpris_player_forget_metadata();
+    g_hash_table_insert(pending, (gpointer)uri_intern(uri), row);
+
+    if(g_hash_table_size(pending) >= db_batch_rows)
+        flush_writes();
+    else if(!flush_timeout)
+        flush_timeout = g_timeout_add(db_batch_ms, flush_when_due, NULL);
+}
+
+// what the db says the file looked like when it was last probed
+static void lookup_fingerprint(const gchar * uri, FileStat * print)
+{
+    // a row that hasn't been flushed yet is newer than what's on disk
+    gpointer unflushed;
+    if(g_hash_table_lookup_extended(pending, uri, NULL, &unflushed))
+    {
+        if(unflushed)
+            *print = ((DbRow *)unflushed)->print;
+        return;
+    }
+
+    if(!db)
+        return;
+
+    sqlite3_reset(fingerprint_stmt);
+    sqlite3_bind_text(fingerprint_stmt, 1, uri, -1, SQLITE_STATIC);
+
+    int result;
+    do {
+        result = sqlite3_step(fingerprint_stmt);
+    } while(result == SQLITE_BUSY);
+
+    if(result == SQLITE_ROW)
+    {
+        print->size  = sqlite3_column_int64(fingerprint_stmt, 0);
+        print->mtime = sqlite3_column_int64(fingerprint_stmt, 1);
+        print->inode = sqlite3_column_int64(fingerprint_stmt, 2);
+    }
+}
+
+static GHashTable * meta_from_row(sqlite3_stmt * stmt)
+{
+    GHashTable * meta = music_metadata_new();
+    add_metadata_from_string(meta, "location",    (const gchar *)sqlite3_column_text(stmt, 0));
+    add_metadata_from_string(meta, "artist",      (const gchar *)sqlite3_column_text(stmt, 1));
+    add_metadata_from_string(meta, "title",       (const gchar *)sqlite3_column_text(stmt, 2));
+    add_metadata_from_string(meta, "album",       (const gchar *)sqlite3_column_text(stmt, 3));
+    add_metadata_from_string(meta, "tracknumber", (const gchar *)sqlite3_column_text(stmt, 4));
+
+    if(sqlite3_column_text(stmt, 5))
+        add_metadata_from_int(meta, "mtime",            sqlite3_column_int(stmt, 5));
+    if(sqlite3_column_text(stmt, 6))
+        add_metadata_from_int(meta, "audio-samplerate", sqlite3_column_int(stmt, 6));
+    if(sqlite3_column_text(stmt, 7))
+        add_metadata_from_int(meta, "audio-bitrate",    sqlite3_column_int(stmt, 7));
+
+    return meta;
+}
+
+// not in db yet, fetch manually and insert it while we have it
+static GHashTable * fetch(const gchar * uri, gboolean autoadd)
+{
+    GHashTable * meta = music_get_playlist_item_metadata(uri);
+    if(autoadd)
+        queue_write(uri, g_hash_table_ref(meta), NULL);
+    return meta;
+}
+
+static GHashTable * get_uncached(const gchar * uri, gboolean autoadd)
+{
+    // rows that haven't been flushed yet are newer than what's on disk
+    gpointer unflushed;
+    if(g_hash_table_lookup_extended(pending, uri, NULL, &unflushed))
+    {
+        if(unflushed)
+            return g_hash_table_ref(((DbRow *)unflushed)->meta);
+        return fetch(uri, autoadd);
+    }
+
     sqlite3_reset(select_stmt);
     sqlite3_bind_text(select_stmt, 1, uri, -1, SQLITE_STATIC);
 
@@ -205,94 +621,223 @@ static GHashTable * get(const gchar * uri, gboolean autoadd)
     {
         if(result != SQLITE_DONE)
             printerr(G_LOG_LEVEL_WARNING, __func__, "Couldn't step select stmt");
-
-        // not in db yet, fetch manually and insert it while we have it
-        GHashTable * meta = music_get_playlist_item_metadata(uri);
-        if(autoadd)
-            update_with_metadata(uri, meta);
-        return meta;
+        return fetch(uri, autoadd);
     }
 
-    GHashTable * meta = g_hash_table_new(g_str_hash, g_str_equal);
-    add_metadata_from_string(meta, "location",    (const gchar *)sqlite3_column_text(select_stmt, 0));
-    add_metadata_from_string(meta, "artist",      (const gchar *)sqlite3_column_text(select_stmt, 1));
-    add_metadata_from_string(meta, "title",       (const gchar *)sqlite3_column_text(select_stmt, 2));
-    add_metadata_from_string(meta, "album",       (const gchar *)sqlite3_column_text(select_stmt, 3));
-    add_metadata_from_string(meta, "tracknumber", (const gchar *)sqlite3_column_text(select_stmt, 4));
-
-    if(sqlite3_column_text(select_stmt, 5))
-        add_metadata_from_int(meta, "mtime",            sqlite3_column_int(select_stmt, 5));
-    if(sqlite3_column_text(select_stmt, 6))
-        add_metadata_from_int(meta, "audio-samplerate", sqlite3_column_int(select_stmt, 6));
-    if(sqlite3_column_text(select_stmt, 7))
-        add_metadata_from_int(meta, "audio-bitrate",    sqlite3_column_int(select_stmt, 7));
+    return meta_from_row(select_stmt);
+}
 
+static GHashTable * get(const gchar * uri, gboolean autoadd)
+{
+    GHashTable * meta;
+    if(!(meta = db_cache_lookup(uri)))
+    {
+        meta = get_uncached(uri, autoadd);
+        db_cache_insert(uri, meta);
+    }
     return meta;
 }
 
 GHashTable * db_get(const gchar * uri) { return get(uri, TRUE); }
 GHashTable * db_get_noadd(const gchar * uri) { return get(uri, FALSE); }
 
-static void update(const gchar * uri)
+// fill in the values of `wanted' (uri -> NULL) with whatever rows the db has
+// for its keys, using a single query.  small sets are looked up by key, big
+// ones by scanning the table once, which beats thousands of index lookups.
+static void select_many(GHashTable * wanted)
 {
-    GHashTable * meta = music_get_playlist_item_metadata(uri);
-    update_with_metadata(uri, meta);
-    g_hash_table_unref(meta);
+    guint n = g_hash_table_size(wanted);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    GString * sql = g_string_new("select * from metadata");
+    if(n <= db_max_bound_uris)
+    {
+        g_string_append(sql, " where location in (?");
+        for(guint i = 1; i < n; i++)
+            g_string_append(sql, ", ?");
+        g_string_append_c(sql, ')');
+    }
+
+    sqlite3_stmt * stmt;
+    int result = sqlite3_prepare_v2(db, sql->str, -1, &stmt, NULL);
+    g_string_free(sql, TRUE);
+    if(result != SQLITE_OK)
+    {
+        printerr(G_LOG_LEVEL_WARNING, __func__, "Couldn't prepare bulk select stmt");
+        return;
+    }
+
+    if(n <= db_max_bound_uris)
+    {
+        gint i = 1;
+        g_hash_table_iter_init(&iter, wanted);
+        while(g_hash_table_iter_next(&iter, &key, &value))
+            sqlite3_bind_text(stmt, i++, (const gchar *)key, -1, SQLITE_STATIC);
+    }
+
+    while((result = sqlite3_step(stmt)) == SQLITE_ROW || result == SQLITE_BUSY)
+    {
+        if(result == SQLITE_BUSY)
+            continue;
+        const gchar * location = (const gchar *)sqlite3_column_text(stmt, 0);
+        if(location && g_hash_table_lookup_extended(wanted, location, &key, &value))
+            g_hash_table_insert(wanted, key, meta_from_row(stmt));
+    }
+
+    if(result != SQLITE_DONE)
+        printerr(G_LOG_LEVEL_WARNING, __func__, "Couldn't step bulk select stmt");
+
+    sqlite3_finalize(stmt);
 }
 
-static void remove(const gchar * uri)
+// metadata for many uris at once, in order.  uris that have never been
+// probed get a table holding only their location rather than being probed
+// here; they're already queued for the workers.
+GPtrArray * db_get_many(const gchar ** uris, guint n)
 {
-    sqlite3_reset(delete_stmt);
-    sqlite3_bind_text(delete_stmt, 1, uri, -1, SQLITE_STATIC);
-    db_return_if_fail(sqlite3_step(delete_stmt), "Couldn't step delete stmt");
-    need_commit = TRUE;
-}
+    GPtrArray * metas = g_ptr_array_sized_new(n);
+    GHashTable * wanted = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, meta_free);
 
-// idle callback functions
+    for(guint i = 0; i < n; i++)
+    {
+        GHashTable * meta = db_cache_lookup(uris[i]);
+        gpointer unflushed;
+        if(!meta && g_hash_table_lookup_extended(pending, uris[i], NULL, &unflushed) && unflushed)
+            meta = g_hash_table_ref(((DbRow *)unflushed)->meta);
+        if(!meta)
+            g_hash_table_insert(wanted, (gpointer)uris[i], NULL);
+        g_ptr_array_add(metas, meta);
+    }
 
-static gboolean process_when_idle(GHashTable * table, void (* runfunc)(const gchar *))
-{
-    GHashTableIter iter;
-    gpointer key, value;
-    g_hash_table_iter_init(&iter, table);
-    if(!g_hash_table_iter_next(&iter, &key, &value))
-        return FALSE;
+    if(db && g_hash_table_size(wanted))
+        select_many(wanted);
 
-    runfunc((const gchar *)key);
-    g_hash_table_iter_remove(&iter);
+    for(guint i = 0; i < n; i++)
+    {
+        if(g_ptr_array_index(metas, i))
+            continue;
+
+        GHashTable * meta = g_hash_table_lookup(wanted, uris[i]);
+        if(meta)
+        {
+            g_hash_table_ref(meta);
+            db_cache_insert(uris[i], meta);
+        }
+        else
+        {
+            meta = music_metadata_new();
+            add_metadata_from_string(meta, "location", uris[i]);
+        }
+        g_ptr_array_index(metas, i) = meta;
+    }
 
-    return !!g_hash_table_size(table);
+    g_hash_table_unref(wanted);
+    return metas;
 }
 
+// idle callback functions
+
+// hand scheduled uris to the workers, keeping at most db_max_in_flight of
+// them outstanding so finished rows can't pile up faster than we write them.
 static gboolean update_when_idle(G_GNUC_UNUSED gpointer data)
 {
-    return process_when_idle(to_update, update);
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, to_update);
+    while(outstanding < db_max_in_flight && g_hash_table_iter_next(&iter, &key, &value))
+    {
+        FileStat known = { 0, 0, 0 };
+        FileStat * seen = (FileStat *)value;
+        lookup_fingerprint((const gchar *)key, &known);
+
+        // found unchanged while enumerating; no need to bother a worker
+        if(seen && seen->inode && fingerprint_equal(seen, &known))
+        {
+            nunchanged++;
+            g_hash_table_iter_remove(&iter);
+            continue;
+        }
+
+        DbTask * task = g_new0(DbTask, 1);
+        task->uri = uri_ref((const gchar *)key);
+        task->generation = ++generation;
+        task->known = known;
+        if(seen && seen->inode)
+        {
+            task->print = *seen;
+            task->have_print = TRUE;
+        }
+
+        g_hash_table_iter_steal(&iter); // in_flight owns the key now
+        g_free(seen);
+        g_hash_table_insert(in_flight, key, GUINT_TO_POINTER(task->generation));
+
+        outstanding++;
+        g_async_queue_push(tasks, task);
+    }
+    return FALSE;
 }
 
-static gboolean remove_when_idle(G_GNUC_UNUSED gpointer data)
+static gboolean drain_results(G_GNUC_UNUSED gpointer data)
 {
-    return process_when_idle(to_remove, remove);
+    // clear the flag first so a result pushed while we drain gets its own
+    // wakeup instead of being stranded
+    g_atomic_int_set(&drain_pending, 0);
+
+    DbTask * task;
+    while((task = g_async_queue_try_pop(results)))
+    {
+        outstanding--;
+        gpointer latest = g_hash_table_lookup(in_flight, task->uri);
+        if(latest && GPOINTER_TO_UINT(latest) == task->generation)
+        {
+            if(task->meta)
+            {
+                nprobed++;
+                queue_write(task->uri, task->meta, &task->print);
+                task->meta = NULL;
+            }
+            else
+                nunchanged++;
+            g_hash_table_remove(in_flight, task->uri);
+        }
+        task_free(task);
+    }
+
+    if(g_hash_table_size(to_update))
+        update_when_idle(NULL);
+
+    return FALSE;
 }
 
 // scheduling functions
 
-static void schedule(GHashTable * add_to, GHashTable * remove_from,
-        gboolean (* idlefunc)(gpointer), const gchar * path)
+// stat is what the caller already knows about the file, or NULL
+void db_schedule_update_stat(const gchar * path, const FileStat * stat)
 {
-    g_hash_table_remove(remove_from, path);
-    gboolean was_empty = !g_hash_table_size(add_to);
-    g_hash_table_insert(add_to, g_strdup(path), GINT_TO_POINTER(1));
+    db_cache_invalidate(path);
+
+    gboolean was_empty = !g_hash_table_size(to_update);
+    g_hash_table_insert(to_update, (gpointer)uri_intern(path),
+            stat ? g_memdup(stat, sizeof(FileStat)) : NULL);
     if(was_empty)
-        g_idle_add_full(G_PRIORITY_LOW, idlefunc, NULL, NULL);
+        g_idle_add_full(G_PRIORITY_LOW, update_when_idle, NULL, NULL);
 }
 
 void db_schedule_update(const gchar * path)
 {
-    schedule(to_update, to_remove, update_when_idle, path);
+    db_schedule_update_stat(path, NULL);
 }
 
 void db_schedule_remove(const gchar * path)
 {
-    schedule(to_remove, to_update, remove_when_idle, path);
+    // playlist_destroy() empties the playlist on the way out; that's no
+    // reason to forget everything we know about it
+    if(main_status == CORN_EXITING)
+        return;
+
+    g_hash_table_remove(to_update, path);
+    g_hash_table_remove(in_flight, path);
+    queue_write(path, NULL, NULL); // also drops it from the cache
 }
-
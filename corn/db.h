@@ -3,12 +3,18 @@
 
 #include <glib.h>
 
+#include "sniff-file.h"
+
 gint db_init(void);
 void db_destroy(void);
 
 void db_schedule_update(const gchar * uri);
+void db_schedule_update_stat(const gchar * uri, const FileStat * stat);
 void db_schedule_remove(const gchar * uri);
+// the tables returned by these are shared with the metadata cache.  drop them
+// with g_hash_table_unref() and never modify them.
 GHashTable * db_get(const gchar * uri);
 GHashTable * db_get_noadd(const gchar * uri);
+GPtrArray * db_get_many(const gchar ** uris, guint n);
 
 #endif
@@ -14,6 +14,7 @@
 #include "mpris-tracklist-glue.h"
 #include "dbus.h"
 #include "main.h"
+#include "state-settings.h"
 
 #include <glib.h>
 #include <dbus/dbus-glib-lowlevel.h>
@@ -34,6 +35,10 @@ MprisTrackList * mpris_tracklist;
 
 static DBusGConnection * bus = NULL;
 
+// the signals that need sending, and the source that will send them
+static guint pending_signals = 0;
+static guint flush_source = 0;
+
 static int mpris_register_objects(DBusGConnection *);
 
 int mpris_init(void)
@@ -59,11 +64,62 @@ int mpris_init(void)
 
 void mpris_destroy(void)
 {
+    // nobody's left to care about what changed on the way out
+    if(flush_source)
+        g_source_remove(flush_source);
+    flush_source = 0;
+    pending_signals = 0;
+    mpris_player_forget_metadata();
+
     if(bus)
         dbus_g_connection_unref(bus);
     bus = NULL;
 }
 
+// changes are announced lazily.  whatever changes mark the signals that
+// describe them, and they're all sent together once the main loop has nothing
+// more pressing to do (or setting_signal_window ms later), each at most once
+// and describing the state as it is by then.  so a burst like skipping to
+// the next track, which stops, starts, changes track and changes caps, costs
+// one message of each kind rather than one per step.
+
+static gboolean flush_signals_func(gpointer data)
+{
+    flush_source = 0;
+    mpris_flush_signals();
+    return FALSE;
+}
+
+void mpris_queue_signals(guint signals)
+{
+    pending_signals |= signals;
+    if(flush_source)
+        return;
+
+    if(setting_signal_window > 0)
+        flush_source = g_timeout_add(setting_signal_window, flush_signals_func, NULL);
+    else
+        flush_source = g_idle_add(flush_signals_func, NULL);
+}
+
+void mpris_flush_signals(void)
+{
+    guint signals = pending_signals;
+    pending_signals = 0;
+    if(flush_source)
+        g_source_remove(flush_source);
+    flush_source = 0;
+
+    if(signals & MPRIS_SIGNAL_TRACK_LIST)
+        mpris_tracklist_send_track_list_change(mpris_tracklist);
+    if(signals & MPRIS_SIGNAL_TRACK)
+        mpris_player_send_track_change(mpris_player);
+    if(signals & MPRIS_SIGNAL_STATUS)
+        mpris_player_send_status_change(mpris_player);
+    if(signals & MPRIS_SIGNAL_CAPS)
+        mpris_player_send_caps_change(mpris_player);
+}
+
 static int mpris_register_objects(DBusGConnection * bus)
 {
     DBusGProxy * bus_proxy = dbus_g_proxy_new_for_name(bus,
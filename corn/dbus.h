@@ -11,7 +11,16 @@ extern MprisRoot * mpris_root;
 extern MprisPlayer * mpris_player;
 extern MprisTrackList * mpris_tracklist;
 
+// for mpris_queue_signals
+#define MPRIS_SIGNAL_CAPS       (1<<0)
+#define MPRIS_SIGNAL_STATUS     (1<<1)
+#define MPRIS_SIGNAL_TRACK      (1<<2)
+#define MPRIS_SIGNAL_TRACK_LIST (1<<3)
+
 int mpris_init(void);
 void mpris_destroy(void);
 
+void mpris_queue_signals(guint signals);
+void mpris_flush_signals(void);
+
 #endif
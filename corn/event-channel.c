@@ -0,0 +1,202 @@
+#include "event-channel.h"
+
+#include <glib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+struct _EventRing
+{
+    EventChannel * chan;
+    gpointer * slots;
+    guint mask;
+    volatile gint head; // next slot to read; only the main loop moves it
+    volatile gint tail; // next slot to write; only the producer moves it
+    volatile gint dropped;
+    guint max_depth;
+};
+
+struct _EventChannel
+{
+    GSource source;
+    GPollFD poll;
+    volatile gint wake_pending;
+    GSList * rings;
+    EventChannelFunc func;
+    EventCoalesceFunc coalesce;
+    GDestroyNotify free_item;
+    gpointer data;
+    guint coalesced;
+};
+
+// producer side
+
+static void wake(EventChannel * chan)
+{
+    // one wakeup per drain is plenty; skip the syscall if it's already due
+    if(!g_atomic_int_compare_and_exchange(&chan->wake_pending, 0, 1))
+        return;
+
+    guint64 one = 1;
+    while(write(chan->poll.fd, &one, sizeof(one)) == -1 && errno == EINTR);
+}
+
+// FALSE if the ring was full, in which case the item is still the caller's
+gboolean event_ring_push(EventRing * ring, gpointer item)
+{
+    guint tail = (guint)ring->tail;
+    guint head = (guint)g_atomic_int_get(&ring->head);
+
+    if(tail - head > ring->mask)
+    {
+        g_atomic_int_inc(&ring->dropped);
+        wake(ring->chan);
+        return FALSE;
+    }
+
+    ring->slots[tail & ring->mask] = item;
+    g_atomic_int_set(&ring->tail, (gint)(tail + 1));
+    wake(ring->chan);
+    return TRUE;
+}
+
+// consumer side
+
+static void drain_ring(EventChannel * chan, EventRing * ring)
+{
+    guint head = (guint)ring->head;
+    guint tail = (guint)g_atomic_int_get(&ring->tail);
+
+    ring->max_depth = MAX(ring->max_depth, tail - head);
+
+    while(head != tail)
+    {
+        gpointer item = ring->slots[head & ring->mask];
+        ++head;
+        g_atomic_int_set(&ring->head, (gint)head); // the slot is free again
+
+        if(head != tail && chan->coalesce &&
+           chan->coalesce(item, ring->slots[head & ring->mask]))
+        {
+            chan->free_item(item);
+            chan->coalesced++;
+        }
+        else
+            chan->func(item, chan->data);
+    }
+}
+
+static gboolean channel_prepare(GSource * source, gint * timeout)
+{
+    *timeout = -1;
+    return FALSE;
+}
+
+static gboolean channel_check(GSource * source)
+{
+    return ((EventChannel *)source)->poll.revents & G_IO_IN;
+}
+
+static gboolean channel_dispatch(GSource * source, GSourceFunc callback, gpointer user_data)
+{
+    EventChannel * chan = (EventChannel *)source;
+
+    guint64 count;
+    while(read(chan->poll.fd, &count, sizeof(count)) == -1 && errno == EINTR);
+
+    // anything pushed from here on gets a wakeup of its own
+    g_atomic_int_set(&chan->wake_pending, 0);
+
+    for(GSList * it = chan->rings; it; it = g_slist_next(it))
+        drain_ring(chan, it->data);
+
+    return TRUE;
+}
+
+static void channel_finalize(GSource * source)
+{
+    EventChannel * chan = (EventChannel *)source;
+
+    for(GSList * it = chan->rings; it; it = g_slist_next(it))
+    {
+        EventRing * ring = it->data;
+        for(guint i = (guint)ring->head; i != (guint)ring->tail; ++i)
+            chan->free_item(ring->slots[i & ring->mask]);
+        g_free(ring->slots);
+        g_free(ring);
+    }
+    g_slist_free(chan->rings);
+
+    while(close(chan->poll.fd) == -1 && errno == EINTR);
+}
+
+static GSourceFuncs channel_funcs = {
+    channel_prepare,
+    channel_check,
+    channel_dispatch,
+    channel_finalize
+};
+
+EventChannel * event_channel_new(EventChannelFunc func, EventCoalesceFunc coalesce,
+                                 GDestroyNotify free_item, gpointer data)
+{
+    gint fd = eventfd(0, 0);
+    if(fd == -1)
+        return NULL;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    EventChannel * chan = (EventChannel *)g_source_new(&channel_funcs, sizeof(EventChannel));
+    chan->poll.fd = fd;
+    chan->poll.events = G_IO_IN;
+    chan->wake_pending = 0;
+    chan->rings = NULL;
+    chan->func = func;
+    chan->coalesce = coalesce;
+    chan->free_item = free_item;
+    chan->data = data;
+    chan->coalesced = 0;
+
+    g_source_add_poll(&chan->source, &chan->poll);
+    g_source_set_priority(&chan->source, G_PRIORITY_HIGH);
+    g_source_attach(&chan->source, NULL);
+    return chan;
+}
+
+// the producers must all have stopped pushing by now
+void event_channel_destroy(EventChannel * chan)
+{
+    g_source_destroy(&chan->source);
+    g_source_unref(&chan->source);
+}
+
+// rings are added before their producer starts and live as long as the
+// channel.  capacity is rounded up to a power of two.
+EventRing * event_channel_add_ring(EventChannel * chan, guint capacity)
+{
+    guint size = 1;
+    while(size < capacity)
+        size <<= 1;
+
+    EventRing * ring = g_new0(EventRing, 1);
+    ring->chan = chan;
+    ring->slots = g_new(gpointer, size);
+    ring->mask = size - 1;
+
+    chan->rings = g_slist_prepend(chan->rings, ring);
+    return ring;
+}
+
+void event_channel_stats(EventChannel * chan, guint * max_depth, guint * ndropped,
+                         guint * ncoalesced)
+{
+    *max_depth = 0;
+    *ndropped = 0;
+    for(GSList * it = chan->rings; it; it = g_slist_next(it))
+    {
+        EventRing * ring = it->data;
+        *max_depth = MAX(*max_depth, ring->max_depth);
+        *ndropped += (guint)g_atomic_int_get(&ring->dropped);
+    }
+    *ncoalesced = chan->coalesced;
+}
@@ -0,0 +1,30 @@
+#ifndef __corn_event_channel_h__
+#define __corn_event_channel_h__
+
+#include <glib.h>
+
+// carries items from other threads to the main loop.  each producer thread
+// gets a ring of its own (single producer, single consumer, no locks), and
+// all the rings of a channel share one eventfd that wakes the main loop.
+
+typedef struct _EventChannel EventChannel;
+typedef struct _EventRing EventRing;
+
+// called on the main loop for each item, which it then owns
+typedef void (* EventChannelFunc)(gpointer item, gpointer data);
+
+// when a ring holds `prev' immediately followed by `next', return TRUE to
+// throw `prev' away and deliver only `next'
+typedef gboolean (* EventCoalesceFunc)(gconstpointer prev, gconstpointer next);
+
+EventChannel * event_channel_new(EventChannelFunc func, EventCoalesceFunc coalesce,
+                                 GDestroyNotify free_item, gpointer data);
+void event_channel_destroy(EventChannel * chan);
+
+EventRing * event_channel_add_ring(EventChannel * chan, guint capacity);
+gboolean event_ring_push(EventRing * ring, gpointer item);
+
+void event_channel_stats(EventChannel * chan, guint * max_depth, guint * ndropped,
+                         guint * ncoalesced);
+
+#endif
@@ -150,9 +150,11 @@ int main(int argc, char **argv)
 
     int failed = 0;
 
-    if(!(failed = db_init()))
+    // the db's metadata workers open their own xine streams, so music comes up
+    // first and goes down last
+    if(!(failed = music_init()))
     {
-        if(!(failed = music_init()))
+        if(!(failed = db_init()))
         {
             if(!(failed = mpris_init()))
             {
@@ -171,9 +173,9 @@ int main(int argc, char **argv)
                 playlist_destroy();
                 mpris_destroy();
             }
-            music_destroy();
+            db_destroy();
         }
-        db_destroy();
+        music_destroy();
     }
     g_main_loop_unref(loop);
 
@@ -5,6 +5,7 @@
 #include "music.h"
 #include "playlist.h"
 #include "state-settings.h"
+#include "db.h"
 
 #include "mpris-player.h"
 
@@ -35,6 +36,13 @@ guint caps_change_signal;
 
 static gint capabilities;
 
+// the current track's metadata.  it's worked out the first time it's wanted
+// after the track changes, and shared by every TrackChange and GetMetadata
+// until the next change, so none of them has to go near the file again.
+static GHashTable * current_meta = NULL;
+static guint current_meta_id = 0;
+static gchar * current_meta_uri = NULL;
+
 G_DEFINE_TYPE(MprisPlayer, mpris_player, G_TYPE_OBJECT)
 
 static void mpris_player_init(MprisPlayer * obj)
@@ -139,7 +147,8 @@ gboolean mpris_player_play(MprisPlayer * obj, GError ** error)
 
 gboolean mpris_player_get_caps(MprisPlayer * obj, gint * caps, GError ** error)
 {
-    *caps = capabilities;
+    // the last CapsChange may not have gone out yet
+    *caps = current_capabilities();
     return TRUE;
 }
 
@@ -174,9 +183,51 @@ gboolean mpris_player_repeat(MprisPlayer * obj, gboolean on, GError ** error)
     return TRUE;
 }
 
-gboolean mpris_player_get_metadata(MprisPlayer * obj, GHashTable ** meta, GError ** error)
+void mpris_player_forget_metadata(void)
+{
+    if(current_meta)
+        g_hash_table_unref(current_meta);
+    g_free(current_meta_uri);
+    current_meta = NULL;
+    current_meta_uri = NULL;
+}
+
+// a reference to the current track's metadata, or NULL if there's no track.
+// the entry's id and uri together tell whether it's still the same track:
+// the id survives the playlist being rearranged, and the uri catches the
+// entry being pointed somewhere else.
+static GHashTable * current_metadata(void)
+{
+    if(playlist_position() == -1)
+        return NULL;
+
+    guint id = playlist_nth_id(playlist_position());
+    const gchar * uri = playlist_current();
+    if(!current_meta || id != current_meta_id || strcmp(uri, current_meta_uri))
+    {
+        mpris_player_forget_metadata();
+
+        // a stream that's open on the track already has it all; otherwise
+        // the db has it from when the track was added
+        if(music_stream && xine_get_status(music_stream) != XINE_STATUS_IDLE)
+            current_meta = music_get_current_track_metadata();
+        else
+            current_meta = db_get(uri);
+        current_meta_id = id;
+        current_meta_uri = g_strdup(uri);
+    }
+    return g_hash_table_ref(current_meta);
+}
+
+// async so that the shared table can be marshalled straight into the reply
+// without being handed over to dbus-glib to free
+gboolean mpris_player_get_metadata(MprisPlayer * obj, DBusGMethodInvocation * context)
 {
-    *meta = music_get_current_track_metadata();
+    GHashTable * meta = current_metadata();
+    if(!meta)
+        meta = music_metadata_new();
+    dbus_g_method_return(context, meta);
+    g_hash_table_unref(meta);
     return TRUE;
 }
 
@@ -199,24 +250,44 @@ gboolean mpris_player_get_status(MprisPlayer * obj, GValue ** status, GError **
     return TRUE;
 }
 
+// the emit functions only note that something changed; the signals go out
+// later, from mpris_flush_signals, through the send functions
+
 gboolean mpris_player_emit_caps_change(MprisPlayer * obj)
 {
-    if(main_status == CORN_RUNNING && refresh_capabilities())
-        g_signal_emit(obj, caps_change_signal, 0, capabilities);
+    mpris_queue_signals(MPRIS_SIGNAL_CAPS);
     return TRUE;
 }
 
 gboolean mpris_player_emit_track_change(MprisPlayer * obj)
 {
-    g_return_val_if_fail(playlist_position() != -1, TRUE);
-    GHashTable * meta = music_get_current_track_metadata();
-    g_signal_emit(obj, track_change_signal, 0, meta);
-    g_hash_table_destroy(meta);
+    mpris_queue_signals(MPRIS_SIGNAL_TRACK);
     return TRUE;
 }
 
 gboolean mpris_player_emit_status_change(MprisPlayer * obj)
 {
-    g_signal_emit(obj, status_change_signal, 0, get_status_struct());
+    mpris_queue_signals(MPRIS_SIGNAL_STATUS);
     return TRUE;
 }
+
+void mpris_player_send_caps_change(MprisPlayer * obj)
+{
+    if(main_status == CORN_RUNNING && refresh_capabilities())
+        g_signal_emit(obj, caps_change_signal, 0, capabilities);
+}
+
+void mpris_player_send_track_change(MprisPlayer * obj)
+{
+    // the playlist may have been emptied since the track changed
+    GHashTable * meta = current_metadata();
+    if(!meta)
+        return;
+    g_signal_emit(obj, track_change_signal, 0, meta);
+    g_hash_table_unref(meta);
+}
+
+void mpris_player_send_status_change(MprisPlayer * obj)
+{
+    g_signal_emit(obj, status_change_signal, 0, get_status_struct());
+}
@@ -23,11 +23,17 @@ gboolean mpris_player_volume_get  (MprisPlayer * obj, gint * vol,         GError
 gboolean mpris_player_position_set(MprisPlayer * obj, gint ms,            GError ** error);
 gboolean mpris_player_position_get(MprisPlayer * obj, gint * ms,          GError ** error);
 gboolean mpris_player_repeat      (MprisPlayer * obj, gboolean on,        GError ** error);
-gboolean mpris_player_get_metadata(MprisPlayer * obj, GHashTable ** meta, GError ** error);
+gboolean mpris_player_get_metadata(MprisPlayer * obj, DBusGMethodInvocation * context);
 gboolean mpris_player_get_status  (MprisPlayer * obj, GValue ** status,   GError ** error);
 
 gboolean mpris_player_emit_caps_change  (MprisPlayer * obj);
 gboolean mpris_player_emit_track_change (MprisPlayer * obj);
 gboolean mpris_player_emit_status_change(MprisPlayer * obj);
 
+void mpris_player_send_caps_change  (MprisPlayer * obj);
+void mpris_player_send_track_change (MprisPlayer * obj);
+void mpris_player_send_status_change(MprisPlayer * obj);
+
+void mpris_player_forget_metadata(void);
+
 #endif
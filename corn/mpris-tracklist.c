@@ -10,6 +10,7 @@
 
 #include "mpris-tracklist.h"
 
+#include <dbus/dbus-glib.h>
 #include <glib.h>
 #include <glib-object.h>
 
@@ -51,9 +52,7 @@ gboolean mpris_tracklist_add_track(MprisTrackList * obj, const gchar * uri,
     }
     else
     {
-        playlist_append(u);
-        if(playnow)
-            playlist_seek(-1);
+        playlist_append_async(u, playnow);
         *failed = 0;
     }
     return TRUE;
@@ -87,13 +86,25 @@ gboolean mpris_tracklist_set_random(MprisTrackList * obj, gboolean on, GError **
     return TRUE;
 }
 
-gboolean mpris_tracklist_get_metadata(MprisTrackList * obj, gint track, GHashTable ** meta, GError ** error)
+// async so that the shared table from the metadata cache can be marshalled
+// straight into the reply without being handed over to dbus-glib to free
+gboolean mpris_tracklist_get_metadata(MprisTrackList * obj, gint track, DBusGMethodInvocation * context)
 {
-    *meta = db_get(playlist_nth(track));
+    GHashTable * meta = (track >= 0 && track < playlist_length())
+        ? db_get(playlist_nth(track))
+        : music_metadata_new();
+    dbus_g_method_return(context, meta);
+    g_hash_table_unref(meta);
     return TRUE;
 }
 
+// queued like the player's signals; see mpris_queue_signals
 void mpris_tracklist_emit_track_list_change(MprisTrackList * obj)
+{
+    mpris_queue_signals(MPRIS_SIGNAL_TRACK_LIST);
+}
+
+void mpris_tracklist_send_track_list_change(MprisTrackList * obj)
 {
     g_signal_emit(obj, track_list_change_signal, 0, playlist_length());
 }
@@ -1,6 +1,7 @@
 #ifndef __corn_mpris_tracklist_h__
 #define __corn_mpris_tracklist_h__
 
+#include <dbus/dbus-glib.h>
 #include <glib-object.h>
 #include <glib.h>
 
@@ -18,8 +19,9 @@ gboolean mpris_tracklist_get_length       (MprisTrackList * obj, gint * len, GEr
 gboolean mpris_tracklist_get_current_track(MprisTrackList * obj, gint * track, GError ** error);
 gboolean mpris_tracklist_set_loop         (MprisTrackList * obj, gboolean on, GError ** error);
 gboolean mpris_tracklist_set_random       (MprisTrackList * obj, gboolean on, GError ** error);
-gboolean mpris_tracklist_get_metadata     (MprisTrackList * obj, gint track, GHashTable ** meta, GError ** error);
+gboolean mpris_tracklist_get_metadata     (MprisTrackList * obj, gint track, DBusGMethodInvocation * context);
 
 void mpris_tracklist_emit_track_list_change(MprisTrackList * obj);
+void mpris_tracklist_send_track_list_change(MprisTrackList * obj);
 
 #endif
@@ -11,6 +11,14 @@ static void do_pause(void)
         xine_close(music_stream);
 }
 
+// pausing leaves the stream open and just stops the clock, so resuming and
+// seeking don't have to open the file all over again.  only stopping or
+// changing tracks closes it.
+static gboolean stream_is_open(void)
+{
+    return xine_get_status(music_stream) == XINE_STATUS_PLAY;
+}
+
 static void do_play(void)
 {
     gint orig_pos = playlist_position();
@@ -31,6 +39,15 @@ static void do_play(void)
 
 void music_play(void)
 {
+    if(music_playing == MUSIC_PAUSED && stream_is_open())
+    {
+        xine_set_param(music_stream, XINE_PARAM_SPEED, XINE_SPEED_NORMAL);
+        music_stream_time = 0;
+        music_playing = MUSIC_PLAYING;
+        mpris_player_emit_status_change(mpris_player);
+        return;
+    }
+
     do_play();
     mpris_player_emit_caps_change(mpris_player); // new song, seekability may have changed
     mpris_player_emit_status_change(mpris_player);
@@ -38,7 +55,11 @@ void music_play(void)
 
 void music_pause(void)
 {
-    do_pause();
+    if(stream_is_open())
+    {
+        xine_set_param(music_stream, XINE_PARAM_SPEED, XINE_SPEED_PAUSE);
+        music_stream_time = music_position();
+    }
     music_playing = MUSIC_PAUSED;
     mpris_player_emit_status_change(mpris_player);
 }
@@ -53,8 +74,21 @@ void music_stop(void)
 
 void music_seek(gint ms)
 {
+    ms = MAX(0, ms); // xine is smart.  no need to check upper bound.
+
+    if(stream_is_open() && xine_play(music_stream, 0, ms))
+    {
+        // xine_play always starts the clock again
+        if(music_playing == MUSIC_PAUSED)
+        {
+            xine_set_param(music_stream, XINE_PARAM_SPEED, XINE_SPEED_PAUSE);
+            music_stream_time = ms;
+        }
+        return;
+    }
+
     do_pause();
-    music_stream_time = MAX(0, ms); // xine is smart.  no need to check upper bound.
+    music_stream_time = ms;
     do_play();
 }
 
@@ -43,6 +43,13 @@ void add_metadata_from_int(GHashTable * meta, const gchar * name, gint num)
     g_hash_table_insert(meta, (gchar *)name, val);
 }
 
+GHashTable * music_metadata_new(void)
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal,
+        NULL, // our keys are all static -- no free function for them
+        free_gvalue_and_its_value);
+}
+
 static GHashTable * get_stream_metadata(GHashTable * meta, xine_stream_t * strm)
 {
     add_metadata_from_string(meta, "title", xine_get_meta_info(strm, XINE_META_INFO_TITLE));
@@ -80,37 +87,122 @@ static GHashTable * get_stream_metadata(GHashTable * meta, xine_stream_t * strm)
     return meta;
 }
 
-GHashTable * music_get_playlist_item_metadata(const gchar * item)
-{
-    g_assert(item != NULL);
+// a probe is a private "none" audio port plus a stream to open files with, so
+// that tags can be read without touching the playback stream.  each probe may
+// only be used by one thread at a time.
 
-    GHashTable * meta = g_hash_table_new_full(g_str_hash, g_str_equal,
-        NULL, // our keys are all static -- no free function for them
-        free_gvalue_and_its_value); // XXX this is copy/paste, refactor
-
-    add_metadata_from_string(meta, "location", item);
+struct _MusicProbe
+{
+    xine_audio_port_t * audio;
+    xine_stream_t * stream;
+};
 
+MusicProbe * music_probe_new(void)
+{
     xine_audio_port_t * audio = xine_open_audio_driver(xine, "none", NULL);
-
-    g_return_val_if_fail(audio != NULL, meta);
+    g_return_val_if_fail(audio != NULL, NULL);
 
     xine_stream_t * strm = xine_stream_new(xine, audio, NULL);
     if(!strm)
     {
         xine_close_audio_driver(xine, audio);
-        g_return_val_if_fail(strm != NULL, meta);
+        g_return_val_if_fail(strm != NULL, NULL);
     }
 
+    MusicProbe * probe = g_new(MusicProbe, 1);
+    probe->audio = audio;
+    probe->stream = strm;
+    return probe;
+}
+
+void music_probe_free(MusicProbe * probe)
+{
+    if(!probe)
+        return;
+    xine_dispose(probe->stream);
+    xine_close_audio_driver(xine, probe->audio);
+    g_free(probe);
+}
+
+GHashTable * music_probe_get_metadata(MusicProbe * probe, const gchar * item)
+{
+    g_assert(item != NULL);
+
+    GHashTable * meta = music_metadata_new();
+
+    add_metadata_from_string(meta, "location", item);
+
+    g_return_val_if_fail(probe != NULL, meta);
+
     gchar * path;
     if(!(path = g_filename_from_utf8(item, -1, NULL, NULL, NULL)))
         g_critical(_("Skipping getting track metadata for '%s'. "
                      "Could not convert from UTF-8. Bug?"), item);
-    else if(xine_open(strm, path))
-        get_stream_metadata(meta, strm);
+    else if(xine_open(probe->stream, path))
+    {
+        get_stream_metadata(meta, probe->stream);
+        xine_close(probe->stream);
+    }
     g_free(path);
 
-    xine_dispose(strm);
-    xine_close_audio_driver(xine, audio);
+    return meta;
+}
+
+// probes are kept around after use so that one-off metadata lookups don't
+// pay for opening an audio driver and a stream every time.
+
+#define probe_pool_max_idle 4
+
+static GStaticMutex probe_pool_lock = G_STATIC_MUTEX_INIT;
+static GQueue probe_pool = G_QUEUE_INIT;
+static guint probes_created = 0;
+static guint probes_reused = 0;
+
+MusicProbe * music_probe_checkout(void)
+{
+    g_static_mutex_lock(&probe_pool_lock);
+    MusicProbe * probe = g_queue_pop_head(&probe_pool);
+    if(probe)
+        probes_reused++;
+    else
+        probes_created++;
+    g_static_mutex_unlock(&probe_pool_lock);
+
+    return probe ? probe : music_probe_new();
+}
+
+void music_probe_return(MusicProbe * probe)
+{
+    if(!probe)
+        return;
+
+    g_static_mutex_lock(&probe_pool_lock);
+    if(g_queue_get_length(&probe_pool) < probe_pool_max_idle)
+    {
+        g_queue_push_head(&probe_pool, probe);
+        probe = NULL;
+    }
+    g_static_mutex_unlock(&probe_pool_lock);
+
+    music_probe_free(probe);
+}
+
+void music_probe_pool_destroy(void)
+{
+    g_static_mutex_lock(&probe_pool_lock);
+    MusicProbe * probe;
+    while((probe = g_queue_pop_head(&probe_pool)))
+        music_probe_free(probe);
+    g_debug("Probe streams: %u created, %u creations avoided by reuse.",
+            probes_created, probes_reused);
+    g_static_mutex_unlock(&probe_pool_lock);
+}
+
+GHashTable * music_get_playlist_item_metadata(const gchar * item)
+{
+    MusicProbe * probe = music_probe_checkout();
+    GHashTable * meta = music_probe_get_metadata(probe, item);
+    music_probe_return(probe);
     return meta;
 }
 
@@ -128,10 +220,7 @@ GHashTable * music_get_current_track_metadata(void)
     // try to do it cheaply, using the already loaded stream
     if(music_stream && xine_get_status(music_stream) != XINE_STATUS_IDLE)
     {
-        GHashTable * meta = g_hash_table_new_full(g_str_hash, g_str_equal,
-            NULL, // our keys are all static -- no free function for them
-            free_gvalue_and_its_value); // XXX refactor
-
+        GHashTable * meta = music_metadata_new();
         get_stream_metadata(meta, music_stream);
         add_metadata_from_string(meta, "location", playlist_current());
         return meta;
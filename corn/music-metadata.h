@@ -5,10 +5,22 @@
 
 #include <glib.h>
 
+typedef struct _MusicProbe MusicProbe;
+
+MusicProbe * music_probe_new(void);
+void music_probe_free(MusicProbe * probe);
+GHashTable * music_probe_get_metadata(MusicProbe * probe, const gchar * item);
+
+MusicProbe * music_probe_checkout(void);
+void music_probe_return(MusicProbe * probe);
+void music_probe_pool_destroy(void);
+
 GHashTable * music_get_playlist_item_metadata(const gchar * item);
 GHashTable * music_get_track_metadata(gint track);
 GHashTable * music_get_current_track_metadata(void);
 
+GHashTable * music_metadata_new(void);
+
 void add_metadata_from_int(GHashTable * meta, const gchar * name, gint num);
 void add_metadata_from_string(GHashTable * meta, const gchar * name, const gchar * str);
 
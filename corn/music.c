@@ -2,9 +2,10 @@
 
 #include "gettext.h"
 #include "music.h"
+#include "music-metadata.h"
 #include "main.h"
 #include "playlist.h"
-#include "sockqueue.h"
+#include "event-channel.h"
 
 #include <glib-object.h>
 #include <xine.h>
@@ -12,16 +13,12 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
 #include <errno.h>
 
 xine_t * xine = NULL;
 xine_stream_t * music_stream = NULL;
 
 static xine_audio_port_t * ao = NULL;
-static xine_event_queue_t * events = NULL;
 
 gint music_stream_time;
 gint music_playing = MUSIC_STOPPED;
@@ -29,27 +26,113 @@ gint music_volume;
 
 static gboolean music_gapless = FALSE;
 
-#define READ 0
-#define WRITE 1
+// xine delivers events on a listener thread per stream.  they're copied,
+// payload and all, into that stream's ring of the event channel, and handled
+// on the main loop.
+//
+// every open gets a new generation, and events are stamped with the
+// generation of whatever their stream had open when they came in.  only
+// those from the open that's playing now get handled: the same stream is
+// reopened for every track that wasn't preloaded, so which stream an event
+// came from says nothing about whether it's stale.
 
-static sockqueue_t * event_queue = NULL;
+#define music_event_ring_size 64
 
-void music_event_send(void * data, const xine_event_t * e)
+typedef struct
+{
+    gint type;
+    gint generation;
+    gchar * mrl;
+} MusicEvent;
+
+typedef struct
+{
+    xine_event_queue_t * queue;
+    EventRing * ring;
+    volatile gint generation; // of what the stream has open
+} StreamListener;
+
+static EventChannel * event_channel = NULL;
+static StreamListener * listener = NULL;
+
+static gint last_generation = 0;
+static gint playing_generation = 0;
+
+// the next track is opened ahead of time on a second stream, so that when the
+// current one finishes all we do is swap the two and start playing, instead of
+// paying for xine_open (which can take a good while on a network share) in
+// the gap between songs.  until it's swapped in, the preload stream is wired
+// to a "none" audio port so that opening it can't disturb what's playing.
+// the open itself runs on a thread of its own.
+
+static xine_stream_t * preload_stream = NULL;
+static xine_audio_port_t * preload_ao = NULL;
+static StreamListener * preload_listener = NULL;
+static GThreadPool * preload_pool = NULL;
+
+static gboolean preload_busy = FALSE; // the preload thread owns preload_stream
+static gchar * preload_wanted = NULL; // what to open once it's done
+static gchar * preload_ready = NULL; // what preload_stream has open
+
+typedef struct
+{
+    gchar * uri;
+    gint generation;
+    gboolean opened;
+} PreloadJob;
+
+static void music_event_free(gpointer data)
 {
-    sockqueue_write(event_queue->fd[WRITE], xine_event_t, e);
+    MusicEvent * me = (MusicEvent *)data;
+    g_free(me->mrl);
+    g_free(me);
 }
 
-gboolean music_event_handle(GIOChannel * source, GIOCondition condition, gpointer data)
+// a burst of identical events from one open means no more than one does
+static gboolean music_event_coalesce(gconstpointer prev, gconstpointer next)
 {
-    xine_event_t e;
-    sockqueue_read(event_queue->fd[READ], xine_event_t, &e);
+    const MusicEvent * a = prev;
+    const MusicEvent * b = next;
+    return a->type == b->type && a->generation == b->generation && !a->mrl && !b->mrl;
+}
+
+// runs on a xine listener thread.  e and anything it points to are only valid
+// for the duration of the call.
+void music_event_send(void * data, const xine_event_t * e)
+{
+    StreamListener * sl = (StreamListener *)data;
+
+    // nothing else is handled, so don't bother waking the main loop for it
+    if(e->type != XINE_EVENT_UI_PLAYBACK_FINISHED &&
+       e->type != XINE_EVENT_MRL_REFERENCE_EXT)
+        return;
+
+    MusicEvent * me = g_new(MusicEvent, 1);
+    me->type = e->type;
+    me->generation = g_atomic_int_get(&sl->generation);
+    me->mrl = e->type == XINE_EVENT_MRL_REFERENCE_EXT
+        ? g_strdup(((xine_mrl_reference_data_ext_t *)e->data)->mrl)
+        : NULL;
+
+    if(!event_ring_push(sl->ring, me))
+        music_event_free(me);
+}
 
-    xine_mrl_reference_data_t * mrl;
+static void music_event_handle(gpointer item, gpointer data)
+{
+    MusicEvent * me = (MusicEvent *)item;
     static gboolean mrl_change = FALSE;
 
+    // stragglers from a track that has since been closed
+    if(me->generation != playing_generation)
+    {
+        music_event_free(me);
+        return;
+    }
+
     if(main_status == CORN_RUNNING)
     {
-        switch(e.type)
+        switch(me->type)
         {
         case XINE_EVENT_UI_PLAYBACK_FINISHED:
 #if defined(XINE_PARAM_GAPLESS_SWITCH) && defined(XINE_PARAM_EARLY_FINISHED_EVENT)
@@ -61,19 +144,141 @@ gboolean music_event_handle(GIOChannel * source, GIOCondition condition, gpointe
             mrl_change = FALSE;
             break;
         case XINE_EVENT_MRL_REFERENCE_EXT:
-            mrl = e.data;
-            g_message("MRL REFERENCE %s", mrl->mrl);
-            playlist_replace_path(mrl->mrl);
+            g_message("MRL REFERENCE %s", me->mrl);
+            playlist_replace_path(me->mrl);
             mrl_change = TRUE;
             break;
         }
     }
 
-    return TRUE;
+    music_event_free(me);
 }
 
 // end inter-thread i/o stuff
 
+static xine_stream_t * stream_new(xine_audio_port_t * port)
+{
+    xine_stream_t * strm = xine_stream_new(xine, port, NULL);
+    if(!strm)
+        return NULL;
+
+    // hey, everyone else is doing it
+    // http://www.google.com/codesearch?q=xine_set_param\(.*%2C\s*XINE_PARAM_METRONOM_PREBUFFER%2C\s*6000
+    xine_set_param(strm, XINE_PARAM_METRONOM_PREBUFFER, 6000);
+
+    xine_set_param(strm, XINE_PARAM_IGNORE_VIDEO, 1);
+    xine_set_param(strm, XINE_PARAM_IGNORE_SPU, 1);
+    return strm;
+}
+
+static StreamListener * stream_listen(xine_stream_t * strm)
+{
+    StreamListener * sl = g_new0(StreamListener, 1);
+    sl->queue = xine_event_new_queue(strm);
+    sl->ring = event_channel_add_ring(event_channel, music_event_ring_size);
+    xine_event_create_listener_thread(sl->queue, music_event_send, sl);
+    return sl;
+}
+
+static void stream_unlisten(StreamListener * sl)
+{
+    xine_event_dispose_queue(sl->queue);
+    g_free(sl);
+}
+
+static void preload_threadfunc(gpointer data, G_GNUC_UNUSED gpointer user_data);
+
+static void preload_start(gchar * uri) // takes ownership
+{
+    g_free(preload_ready);
+    preload_ready = NULL;
+    preload_busy = TRUE;
+
+    PreloadJob * job = g_new(PreloadJob, 1);
+    job->uri = uri;
+    job->generation = ++last_generation;
+    job->opened = FALSE;
+    g_thread_pool_push(preload_pool, job, NULL);
+}
+
+static gboolean preload_done(gpointer data)
+{
+    PreloadJob * job = (PreloadJob *)data;
+
+    preload_busy = FALSE;
+    if(job->opened)
+        preload_ready = job->uri;
+    else
+        g_free(job->uri);
+    g_free(job);
+
+    if(preload_wanted)
+    {
+        gchar * uri = preload_wanted;
+        preload_wanted = NULL;
+        preload_start(uri);
+    }
+    return FALSE;
+}
+
+static void preload_threadfunc(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+    PreloadJob * job = (PreloadJob *)data;
+
+    if(xine_get_status(preload_stream) != XINE_STATUS_IDLE)
+        xine_close(preload_stream);
+    g_atomic_int_set(&preload_listener->generation, job->generation);
+
+    gchar * path = g_filename_from_utf8(job->uri, -1, NULL, NULL, NULL);
+    if(path)
+        job->opened = xine_open(preload_stream, path);
+    g_free(path);
+
+    g_idle_add(preload_done, job);
+}
+
+// open whatever would play after the current track, unless it's open already
+static void preload_next(void)
+{
+    gint next = playlist_peek_next();
+    if(next < 0)
+        return;
+
+    const gchar * uri = playlist_nth(next);
+    if(preload_busy)
+    {
+        g_free(preload_wanted);
+        preload_wanted = g_strdup(uri);
+    }
+    else if(!preload_ready || strcmp(preload_ready, uri))
+        preload_start(g_strdup(uri));
+}
+
+// if the current track is the one that was preloaded, make its stream the
+// playing one.  the stream it replaces must already be closed.
+static gboolean preload_take(void)
+{
+    if(preload_busy || !preload_ready || strcmp(preload_ready, playlist_current()))
+        return FALSE;
+
+    xine_stream_t * strm = music_stream;
+    music_stream = preload_stream;
+    preload_stream = strm;
+
+    StreamListener * sl = listener;
+    listener = preload_listener;
+    preload_listener = sl;
+    playing_generation = g_atomic_int_get(&listener->generation);
+
+    xine_post_wire_audio_port(xine_get_audio_source(preload_stream), preload_ao);
+    xine_post_wire_audio_port(xine_get_audio_source(music_stream), ao);
+    xine_set_param(music_stream, XINE_PARAM_AUDIO_VOLUME, music_volume);
+
+    g_free(preload_ready);
+    preload_ready = NULL;
+    return TRUE;
+}
+
 int music_init()
 {
     char * configfile;
@@ -104,31 +309,36 @@ int music_init()
         return 11;
     }
 
-    if(!(music_stream = xine_stream_new(xine, ao, NULL)))
+    if(!(preload_ao = xine_open_audio_driver(xine, "none", NULL)))
+    {
+        g_critical(_("Unable to open audio driver from Xine."));
+        return 11;
+    }
+
+    if(!(music_stream = stream_new(ao)) || !(preload_stream = stream_new(preload_ao)))
     {
         g_critical(_("Unable to open a Xine stream."));
         return 12;
     }
 
-    // hey, everyone else is doing it
-    // http://www.google.com/codesearch?q=xine_set_param\(.*%2C\s*XINE_PARAM_METRONOM_PREBUFFER%2C\s*6000
-    xine_set_param(music_stream, XINE_PARAM_METRONOM_PREBUFFER, 6000);
-
-    xine_set_param(music_stream, XINE_PARAM_IGNORE_VIDEO, 1);
-    xine_set_param(music_stream, XINE_PARAM_IGNORE_SPU, 1);
-
-    if(!(event_queue = sockqueue_create()))
+    if(!(event_channel = event_channel_new(music_event_handle, music_event_coalesce,
+                                           music_event_free, NULL)))
     {
-        g_critical("%s (%s).", _("Unable to open event socket pair"), g_strerror(errno));
+        g_critical("%s (%s).", _("Unable to open event channel"), g_strerror(errno));
         return 13;
     }
 
-    events = xine_event_new_queue(music_stream);
-    xine_event_create_listener_thread(events, music_event_send, NULL);
+    listener = stream_listen(music_stream);
+    preload_listener = stream_listen(preload_stream);
 
-    GIOChannel * chan = g_io_channel_unix_new(event_queue->fd[READ]);
-    g_io_add_watch_full(chan, G_PRIORITY_HIGH, G_IO_IN, music_event_handle, NULL, NULL);
-    g_io_channel_unref(chan);
+    GError * error = NULL;
+    preload_pool = g_thread_pool_new(preload_threadfunc, NULL, 1, FALSE, &error);
+    if(error)
+    {
+        g_critical("%s (%s).", _("Couldn't create thread pool"), error->message);
+        g_error_free(error);
+        return 14;
+    }
 
 #if defined(XINE_PARAM_GAPLESS_SWITCH) && defined(XINE_PARAM_EARLY_FINISHED_EVENT)
     music_gapless = xine_check_version(1, 1, 1);
@@ -141,13 +351,29 @@ int music_init()
 
 void music_destroy()
 {
+    g_thread_pool_free(preload_pool, FALSE, TRUE);
+    g_free(preload_wanted);
+    g_free(preload_ready);
+
+    if(xine_get_status(preload_stream) != XINE_STATUS_IDLE)
+        xine_close(preload_stream);
+    stream_unlisten(preload_listener);
+    xine_dispose(preload_stream);
+    xine_close_audio_driver(xine, preload_ao);
+
     if(xine_get_status(music_stream) != XINE_STATUS_IDLE)
         xine_close(music_stream);
-    xine_event_dispose_queue(events);
+    stream_unlisten(listener);
     xine_dispose(music_stream);
+    music_probe_pool_destroy();
     xine_close_audio_driver(xine, ao);
     xine_exit(xine);
-    sockqueue_destroy(event_queue);
+
+    guint depth, dropped, coalesced;
+    event_channel_stats(event_channel, &depth, &dropped, &coalesced);
+    g_debug("Xine events: deepest queue %u, %u dropped, %u coalesced.",
+            depth, dropped, coalesced);
+    event_channel_destroy(event_channel);
 }
 
 // TODO: instead of returning bool, return { MUSIC_PLAYBACK_STARTED, MUSIC_PLAYBACK_ALREADY, MUSIC_PLAYBACK_SONG_FAILED, MUSIC_PLAYBACK_NO_MUSIC }
@@ -159,21 +385,27 @@ gboolean music_try_to_play(void)
     if(playlist_empty())
         return TRUE;
 
-    gchar * path;
-    if(!(path = g_filename_from_utf8(playlist_current(), -1, NULL, NULL, NULL)))
-    {
-        g_critical(_("Skipping '%s'. Could not convert from UTF-8. Bug?"),
-                   playlist_current());
-        return FALSE;
-    }
-
     if(xine_get_status(music_stream) != XINE_STATUS_IDLE)
         xine_close(music_stream);
 
-    gboolean opened = xine_open(music_stream, path);
-    g_free(path);
-    if(!opened)
-        return FALSE;
+    if(!preload_take())
+    {
+        playing_generation = ++last_generation;
+        g_atomic_int_set(&listener->generation, playing_generation);
+
+        gchar * path;
+        if(!(path = g_filename_from_utf8(playlist_current(), -1, NULL, NULL, NULL)))
+        {
+            g_critical(_("Skipping '%s'. Could not convert from UTF-8. Bug?"),
+                       playlist_current());
+            return FALSE;
+        }
+
+        gboolean opened = xine_open(music_stream, path);
+        g_free(path);
+        if(!opened)
+            return FALSE;
+    }
 
 #if defined(XINE_PARAM_GAPLESS_SWITCH) && defined(XINE_PARAM_EARLY_FINISHED_EVENT)
     if(music_gapless)
@@ -184,6 +416,7 @@ gboolean music_try_to_play(void)
     {
         music_stream_time = 0;
         music_playing = MUSIC_PLAYING;
+        preload_next();
         return TRUE;
     }
     music_playing = MUSIC_STOPPED;
@@ -12,10 +12,95 @@
 
 GQueue found_files = G_QUEUE_INIT;
 
-static gchar ** read_file(GFile * file)
+// background scans hand what they've found so far to the main loop every
+// this many files, so the playlist fills up while the scan is still going.
+#define parse_batch_size 256
+
+// state for one parse.  a synchronous parse collects straight into
+// found_files; a background one collects into its own queue and passes it on
+// to `func' in batches.
+typedef struct
+{
+    GQueue * found;
+    guint nfound;
+    GCancellable * cancellable;
+    ParseBatchFunc func;
+    gpointer data;
+    guint ndirs;
+    guint nfiles;
+    guint nrejected;
+    GTimer * timer;
+} ParseContext;
+
+typedef struct
+{
+    GQueue * found;
+    guint nfound;
+    gboolean done;
+    ParseBatchFunc func;
+    gpointer data;
+    guint source;
+} ParseBatch;
+
+static GThreadPool * scan_pool = NULL;
+static GCancellable * scan_cancellable = NULL;
+
+// batches handed over but not yet delivered, in order
+static GStaticMutex batch_lock = G_STATIC_MUTEX_INIT;
+static GQueue undelivered = G_QUEUE_INIT;
+
+static void parse_into(ParseContext * ctx, const gchar * path);
+static void parse_known(ParseContext * ctx, const gchar * path, GFileType known_type,
+                        const FileStat * known_stat);
+
+static gboolean deliver_batch(gpointer data)
+{
+    ParseBatch * batch = (ParseBatch *)data;
+
+    g_static_mutex_lock(&batch_lock);
+    g_queue_remove(&undelivered, batch);
+    g_static_mutex_unlock(&batch_lock);
+
+    batch->func(batch->found, batch->nfound, batch->done, batch->data);
+    g_queue_free(batch->found);
+    g_free(batch);
+    return FALSE;
+}
+
+static void hand_over(ParseContext * ctx, gboolean done)
+{
+    ParseBatch * batch = g_new(ParseBatch, 1);
+    batch->found = ctx->found;
+    batch->nfound = ctx->nfound;
+    batch->done = done;
+    batch->func = ctx->func;
+    batch->data = ctx->data;
+
+    // held across the two so the batch is queued before it can be delivered
+    g_static_mutex_lock(&batch_lock);
+    batch->source = g_idle_add(deliver_batch, batch);
+    g_queue_push_tail(&undelivered, batch);
+    g_static_mutex_unlock(&batch_lock);
+
+    ctx->found = g_queue_new();
+}
+
+static void found(ParseContext * ctx, FoundFile * ff)
+{
+    g_queue_push_tail(ctx->found, ff);
+    ctx->nfound++;
+    if(ff->type & SNIFFED_DIRECTORY)
+        ctx->ndirs++;
+    else if(ff->type & SNIFFED_FILE)
+        ctx->nfiles++;
+    if(ctx->func && g_queue_get_length(ctx->found) >= parse_batch_size)
+        hand_over(ctx, FALSE);
+}
+
+static gchar ** read_file(ParseContext * ctx, GFile * file)
 {
     gchar * buf;
-    if(!g_file_load_contents(file, NULL, &buf, NULL, NULL, NULL))
+    if(!g_file_load_contents(file, ctx->cancellable, &buf, NULL, NULL, NULL))
         return NULL;
 
     g_strdelimit(buf, "\r", '\n'); // \r is used on some platforms
@@ -41,10 +126,10 @@ static gchar * add_relative_dir(GFile * dir, const gchar * name, gboolean force)
     return abs_uri;
 }
 
-static void parse_m3u(GFile * m3u)
+static void parse_m3u(ParseContext * ctx, GFile * m3u)
 {
     gchar ** lines;
-    if((lines = read_file(m3u)))
+    if((lines = read_file(ctx, m3u)))
     {
         GFile * dir = g_file_get_parent(m3u);
         gint i;
@@ -53,20 +138,20 @@ static void parse_m3u(GFile * m3u)
             lines[i] = g_strstrip(lines[i]);
             if(lines[i][0] == '\0' || lines[i][0] == '#')
                 continue;
-            parse_file(add_relative_dir(dir, lines[i], FALSE));
+            parse_into(ctx, add_relative_dir(dir, lines[i], FALSE));
         }
         g_object_unref(dir);
         g_strfreev(lines);
     }
 }
 
-static void parse_pls(GFile * pls)
+static void parse_pls(ParseContext * ctx, GFile * pls)
 {
     GKeyFile * keyfile = g_key_file_new();
 
     gchar * buf;
     gsize length;
-    if(!g_file_load_contents(pls, NULL, &buf, &length, NULL, NULL) ||
+    if(!g_file_load_contents(pls, ctx->cancellable, &buf, &length, NULL, NULL) ||
        !g_key_file_load_from_data(keyfile, buf, length, G_KEY_FILE_NONE, NULL) ||
        !g_key_file_has_group(keyfile, "playlist") ||
        !g_key_file_has_key(keyfile, "playlist", "NumberOfEntries", NULL))
@@ -84,7 +169,7 @@ static void parse_pls(GFile * pls)
             gchar * file_key = g_strdup_printf("File%d", i);
             gchar * file = g_key_file_get_value(keyfile, "playlist", file_key, NULL);
             if(file && file[0] != '\0')
-                parse_file(add_relative_dir(dir, file, FALSE));
+                parse_into(ctx, add_relative_dir(dir, file, FALSE));
             g_free(file_key);
             g_free(file);
         }
@@ -94,58 +179,234 @@ static void parse_pls(GFile * pls)
     g_key_file_free(keyfile);
 }
 
-static void parse_dir_fail(GFile * dir, GError * error)
+static void parse_dir_fail(ParseContext * ctx, GFile * dir, GError * error)
 {
-    gchar * uri = g_file_get_uri(dir);
-    g_warning("Can't list contents of directory %s (%s).", uri, error->message);
+    if(!g_cancellable_is_cancelled(ctx->cancellable))
+    {
+        gchar * uri = g_file_get_uri(dir);
+        g_warning("Can't list contents of directory %s (%s).", uri, error->message);
+        g_free(uri);
+    }
     g_error_free(error);
-    g_free(uri);
 }
 
-void parse_dir(GFile * dir)
+// directories are listed by a pool of walker threads, so the subdirectories
+// of a big tree get enumerated side by side instead of one after another.
+// the thread doing the parse then visits the listings in order, waiting on
+// any that aren't finished yet, so the result comes out exactly as a plain
+// recursive walk would produce it.
+
+#define parse_walker_count 4
+
+typedef struct _WalkDir WalkDir;
+
+// the type and stat come along from the listing so that neither sniffing nor
+// the db has to ask the filesystem about the file again
+typedef struct
 {
+    gchar * uri;
+    GFileType type;
+    FileStat stat;
+    WalkDir * subdir;
+} WalkEntry;
+
+struct _WalkDir
+{
+    GFile * dir;
+    GCancellable * cancellable;
+    gboolean listed;
+    GError * error;
+    GArray * entries; // of WalkEntry, sorted
+};
+
+static GStaticMutex walk_lock = G_STATIC_MUTEX_INIT;
+static GCond * walk_cond = NULL;
+static GThreadPool * walk_pool = NULL;
+
+static void walk_push(WalkDir * wd);
+
+static WalkDir * walk_dir_new(GFile * dir, GCancellable * cancellable)
+{
+    WalkDir * wd = g_new0(WalkDir, 1);
+    wd->dir = g_object_ref(dir);
+    wd->cancellable = cancellable;
+    return wd;
+}
+
+// every uri in a listing starts with the same directory uri, so the sort
+// skips past that and only compares the part that differs
+static gint walk_entry_cmp(gconstpointer a, gconstpointer b, gpointer prefix_len)
+{
+    gsize skip = GPOINTER_TO_SIZE(prefix_len);
+    const gchar * x = ((const WalkEntry *)a)->uri + skip;
+    const gchar * y = ((const WalkEntry *)b)->uri + skip;
+    gint cmp = g_ascii_strcasecmp(x, y);
+    // g_array_sort isn't stable, so break case-only ties explicitly
+    return cmp ? cmp : strcmp(x, y);
+}
+
+static void walk_entries_free(GArray * entries)
+{
+    for(guint i = 0; i < entries->len; ++i)
+        g_free(g_array_index(entries, WalkEntry, i).uri);
+    g_array_free(entries, TRUE);
+}
+
+static void walk_threadfunc(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+    WalkDir * wd = (WalkDir *)data;
     GError * error = NULL;
-    GFileEnumerator * fenum = g_file_enumerate_children(dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
-            G_FILE_QUERY_INFO_NONE, NULL, &error);
+    GArray * entries = g_array_new(FALSE, FALSE, sizeof(WalkEntry));
 
-    if(error)
-    {
-        parse_dir_fail(dir, error);
-        return;
-    }
+    gchar * dir_uri = g_file_get_uri(wd->dir);
+    gsize prefix_len = strlen(dir_uri);
 
-    GSList * entries = NULL;
-    for(;;)
-    {
-        GFileInfo * info = g_file_enumerator_next_file(fenum, NULL, &error);
-        if(error)
-        {
-            g_object_unref(fenum);
-            parse_dir_fail(dir, error);
-            return;
-        }
+    GFileEnumerator * fenum = g_file_enumerate_children(wd->dir,
+            G_FILE_ATTRIBUTE_STANDARD_NAME "," SNIFF_FILE_ATTRIBUTES,
+            G_FILE_QUERY_INFO_NONE, wd->cancellable, &error);
 
+    while(fenum)
+    {
+        GFileInfo * info = g_file_enumerator_next_file(fenum, wd->cancellable, &error);
         if(!info)
             break;
 
         const gchar * name = g_file_info_get_attribute_byte_string(info, G_FILE_ATTRIBUTE_STANDARD_NAME);
 
+        // hidden files are dropped here, before paying for a uri
         if(name && name[0] != '.')
-            entries = g_slist_append(entries, add_relative_dir(dir, name, TRUE));
+        {
+            WalkEntry e;
+            e.uri = add_relative_dir(wd->dir, name, TRUE);
+            e.type = g_file_info_get_file_type(info);
+            sniff_file_stat_from_info(info, &e.stat);
+            e.subdir = NULL;
+            if(strncmp(e.uri, dir_uri, prefix_len))
+                prefix_len = 0;
+            g_array_append_val(entries, e);
+        }
 
         g_object_unref(info);
     }
 
-    g_object_unref(fenum);
+    if(fenum)
+        g_object_unref(fenum);
+    g_free(dir_uri);
 
-    entries = g_slist_sort(entries, (GCompareFunc)g_ascii_strcasecmp);
-    for(GSList * it = entries; it; it = g_slist_next(it))
-        parse_file(it->data);
+    if(error)
+    {
+        walk_entries_free(entries);
+        entries = NULL;
+    }
+    else
+    {
+        g_array_sort_with_data(entries, walk_entry_cmp, GSIZE_TO_POINTER(prefix_len));
 
-    g_slist_free(entries);
+        // queue the subdirectories only once the listing is known to be
+        // good, so a failed listing never leaves orphans in the pool
+        for(guint i = 0; i < entries->len; ++i)
+        {
+            WalkEntry * e = &g_array_index(entries, WalkEntry, i);
+            if(e->type == G_FILE_TYPE_DIRECTORY)
+            {
+                GFile * sub = g_file_new_for_uri(e->uri);
+                e->subdir = walk_dir_new(sub, wd->cancellable);
+                g_object_unref(sub);
+                walk_push(e->subdir);
+            }
+        }
+    }
+
+    g_static_mutex_lock(&walk_lock);
+    wd->entries = entries;
+    wd->error = error;
+    wd->listed = TRUE;
+    g_cond_broadcast(walk_cond);
+    g_static_mutex_unlock(&walk_lock);
 }
 
-void parse_file(const gchar * path)
+static void walk_push(WalkDir * wd)
+{
+    g_static_mutex_lock(&walk_lock);
+
+    if(!walk_pool)
+    {
+        GError * error = NULL;
+        walk_cond = g_cond_new();
+        walk_pool = g_thread_pool_new(walk_threadfunc, NULL, parse_walker_count, TRUE, &error);
+        if(error)
+            g_error("%s (%s).\n", _("Couldn't create thread pool"), error->message);
+    }
+
+    GError * error = NULL;
+    g_thread_pool_push(walk_pool, wd, &error);
+    if(error)
+        g_error("%s (%s).\n", _("Couldn't push thread to scan directory"), error->message);
+
+    g_static_mutex_unlock(&walk_lock);
+}
+
+// consumes and frees wd, along with everything below it
+static void walk_visit(ParseContext * ctx, WalkDir * wd)
+{
+    g_static_mutex_lock(&walk_lock);
+    while(!wd->listed)
+        g_cond_wait(walk_cond, g_static_mutex_get_mutex(&walk_lock));
+    g_static_mutex_unlock(&walk_lock);
+
+    if(wd->error)
+        parse_dir_fail(ctx, wd->dir, wd->error);
+
+    for(guint i = 0; wd->entries && i < wd->entries->len; ++i)
+    {
+        WalkEntry * e = &g_array_index(wd->entries, WalkEntry, i);
+        if(e->subdir)
+        {
+            // still walk it after a cancel, to free what's queued below it
+            walk_visit(ctx, e->subdir);
+
+            FoundFile * ff = g_new(FoundFile, 1);
+            ff->uri = e->uri;
+            ff->type = SNIFFED_DIRECTORY;
+            ff->stat = e->stat;
+            found(ctx, ff);
+        }
+        else
+        {
+            if(!g_cancellable_is_cancelled(ctx->cancellable))
+                parse_known(ctx, e->uri, e->type, &e->stat);
+            g_free(e->uri);
+        }
+    }
+
+    if(wd->entries)
+        g_array_free(wd->entries, TRUE);
+    g_object_unref(wd->dir);
+    g_free(wd);
+}
+
+static void parse_dir(ParseContext * ctx, GFile * dir)
+{
+    WalkDir * wd = walk_dir_new(dir, ctx->cancellable);
+    walk_push(wd);
+    walk_visit(ctx, wd);
+}
+
+static void walk_stop(void)
+{
+    if(!walk_pool)
+        return;
+
+    // the cancellable has been triggered, so whatever's still queued finishes
+    // straight away
+    g_thread_pool_free(walk_pool, FALSE, TRUE);
+    g_cond_free(walk_cond);
+    walk_pool = NULL;
+    walk_cond = NULL;
+}
+
+static void parse_known(ParseContext * ctx, const gchar * path, GFileType known_type,
+                        const FileStat * known_stat)
 {
     g_return_if_fail(path != NULL);
 
@@ -153,15 +414,159 @@ void parse_file(const gchar * path)
         ? g_file_new_for_uri(path)
         : g_file_new_for_path(path);
 
-    FoundFile * ff = sniff_file(path, file);
+    FoundFile * ff = sniff_file(path, file, known_type, known_stat);
+
+    // cover art, rip logs and so on never make it as far as the playlist
+    if(ff->type & SNIFFED_REJECTED)
+    {
+        ctx->nrejected++;
+        g_object_unref(file);
+        g_free(ff);
+        return;
+    }
 
     if(ff->type & SNIFFED_DIRECTORY)
-        parse_dir(file);
+        parse_dir(ctx, file);
     else if(ff->type & SNIFFED_M3U)
-        parse_m3u(file);
+        parse_m3u(ctx, file);
     else if(ff->type & SNIFFED_PLS)
-        parse_pls(file);
+        parse_pls(ctx, file);
 
     g_object_unref(file);
-    g_queue_push_tail(&found_files, ff);
+    found(ctx, ff);
+}
+
+static void parse_into(ParseContext * ctx, const gchar * path)
+{
+    parse_known(ctx, path, G_FILE_TYPE_UNKNOWN, NULL);
+}
+
+static void report_throughput(ParseContext * ctx, const gchar * path)
+{
+    gdouble secs = g_timer_elapsed(ctx->timer, NULL);
+    gdouble div = secs > 0.0 ? secs : 1.0;
+    g_debug("Scanned %s: %u directories, %u files (%u skipped) in %.2fs "
+            "(%.0f directories/s, %.0f files/s).",
+            path, ctx->ndirs, ctx->nfiles, ctx->nrejected, secs,
+            ctx->ndirs / div, ctx->nfiles / div);
+    g_timer_destroy(ctx->timer);
+}
+
+void parse_file(const gchar * path)
+{
+    ParseContext ctx = { &found_files, 0, NULL, NULL, NULL, 0, 0, 0, g_timer_new() };
+    parse_into(&ctx, path);
+    report_throughput(&ctx, path);
+}
+
+// background scans run one at a time on their own thread, in the order they
+// were requested, so that adding two directories back to back still appends
+// them in that order.
+
+typedef struct
+{
+    gchar ** paths;
+    ParseBatchFunc func;
+    gpointer data;
+} ScanRequest;
+
+static void scan_threadfunc(gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+    ScanRequest * req = (ScanRequest *)data;
+
+    // all the paths of a request share one context, so their files are
+    // batched together and the last batch is the only one marked done
+    ParseContext ctx = { g_queue_new(), 0, scan_cancellable, req->func, req->data, 0, 0, 0, g_timer_new() };
+    for(gchar ** path = req->paths; *path && !g_cancellable_is_cancelled(ctx.cancellable); path++)
+        parse_into(&ctx, *path);
+    hand_over(&ctx, TRUE);
+
+    guint npaths = g_strv_length(req->paths);
+    gchar * what = npaths == 1
+        ? g_strdup(req->paths[0])
+        : g_strdup_printf("%u paths", npaths);
+    report_throughput(&ctx, what);
+    g_free(what);
+    g_queue_free(ctx.found);
+
+    g_strfreev(req->paths);
+    g_free(req);
+}
+
+void parse_file_async(gchar * path, ParseBatchFunc func, gpointer data)
+{
+    g_return_if_fail(path != NULL);
+
+    gchar ** paths = g_new(gchar *, 2);
+    paths[0] = path;
+    paths[1] = NULL;
+    parse_files_async(paths, func, data);
+}
+
+// like parse_file_async for a NULL-terminated vector of paths, which it takes
+// ownership of.  they're scanned in order as a single scan.
+void parse_files_async(gchar ** paths, ParseBatchFunc func, gpointer data)
+{
+    g_return_if_fail(paths != NULL);
+
+    if(!scan_pool)
+    {
+        GError * error = NULL;
+        scan_cancellable = g_cancellable_new();
+        scan_pool = g_thread_pool_new(scan_threadfunc, NULL, 1, FALSE, &error);
+        if(error)
+            g_error("%s (%s).\n", _("Couldn't create thread pool"), error->message);
+    }
+
+    ScanRequest * req = g_new(ScanRequest, 1);
+    req->paths = paths;
+    req->func = func;
+    req->data = data;
+
+    GError * error = NULL;
+    g_thread_pool_push(scan_pool, req, &error);
+    if(error)
+        g_error("%s (%s).\n", _("Couldn't push thread to scan directory"), error->message);
+}
+
+// scans still queued are run rather than dropped, so that each one gets its
+// last call and its func can free its data; once cancelled they skip all the
+// i/o.  batches that haven't reached the main loop yet are delivered here and
+// now, but empty.
+void parse_cancel_all(void)
+{
+    if(scan_pool)
+    {
+        g_cancellable_cancel(scan_cancellable);
+        g_thread_pool_free(scan_pool, FALSE, TRUE);
+        scan_pool = NULL;
+    }
+
+    // nothing can be waiting on a listing any more
+    walk_stop();
+
+    if(scan_cancellable)
+        g_object_unref(scan_cancellable);
+    scan_cancellable = NULL;
+
+    g_static_mutex_lock(&batch_lock);
+    GQueue left = undelivered;
+    g_queue_init(&undelivered);
+    g_static_mutex_unlock(&batch_lock);
+
+    ParseBatch * batch;
+    while((batch = g_queue_pop_head(&left)))
+    {
+        g_source_remove(batch->source);
+
+        FoundFile * ff;
+        while((ff = g_queue_pop_head(batch->found)))
+        {
+            g_free(ff->uri);
+            g_free(ff);
+        }
+        batch->func(batch->found, batch->nfound, batch->done, batch->data);
+        g_queue_free(batch->found);
+        g_free(batch);
+    }
 }
@@ -3,7 +3,16 @@
 
 #include <glib.h>
 
+// called on the main loop with the FoundFiles a background scan has turned
+// up since the last call.  pop them all off; the queue itself is freed
+// afterwards.  nfound is the running total, done is TRUE on the last call,
+// which always comes, even for a scan cut short by parse_cancel_all().
+typedef void (* ParseBatchFunc)(GQueue * found, guint nfound, gboolean done, gpointer data);
+
 void parse_file(const gchar * path);
+void parse_file_async(gchar * path, ParseBatchFunc func, gpointer data);
+void parse_files_async(gchar ** paths, ParseBatchFunc func, gpointer data);
+void parse_cancel_all(void);
 
 extern GQueue found_files;
 
@@ -2,97 +2,226 @@
 
 #include <glib.h>
 
-// we record songs played in the past and the future so that you can go
-// backwards/forwards when random is on, and still get the sense of a playlist
-// of sorts, not just "play $RANDOM whenever i hit a button"
+// shuffle plays every track once, in random order, before any track comes
+// around again.  the order is drawn lazily, one track at a time (an
+// incremental fisher-yates): `pool' holds the tracks that haven't had their
+// turn yet this round, and each step takes a random one out of it.  once the
+// pool runs dry, a new round starts with every track back in it.
 //
-//                              current song
-//                                   |
-//                                   |
-//                                   v
-//  ..---------------------+---------+----------+-------------------------..
-//   ...the forgotten past |   past  |  future  | the unrecorded future...
-//  ..---------------------+---------+----------+-------------------------..
+// every track played is appended to `history', which is never trimmed, so
+// you can go backwards and forwards as far as you like and still get the
+// sense of a playlist of sorts, not just "play $RANDOM whenever i hit a
+// button"
+//
+//                        current song (cursor)
+//                                |
+//                                v
+//  +-----------------------------+--------------+ +--------------------+
+//  |            past             |    future    | | pool: not yet      |
+//  |   (all of it, every round)  | (been there) | | drawn, no order    |
+//  +-----------------------------+--------------+ +--------------------+
+//
+// tracks are kept by playlist id rather than position, so nothing here needs
+// fixing up when the playlist is rearranged.  removed tracks are dropped from
+// the pool right away but left in the history, where they're skipped over
+// and eventually compacted out.
+
+// don't bother compacting the history until it's at least this long
+#define history_compact_min 1024
 
-// past and future each get this many entries
-static const gint history_size = 20;
+static GArray * history = NULL; // of guint ids
+static guint cursor = 0;        // the current track, if history isn't empty
+static GArray * pool = NULL;    // of guint ids
+static guint compact_at = history_compact_min;
 
-static GQueue past = G_QUEUE_INIT;
-static GQueue future = G_QUEUE_INIT;
+// every track in the playlist: id -> its index in the pool + 1, or 0 if it
+// has already been drawn this round
+static GHashTable * tracks = NULL;
 
 void plrand_init(void)
 {
-    g_queue_init(&past);
-    g_queue_init(&future);
+    history = g_array_new(FALSE, FALSE, sizeof(guint));
+    pool = g_array_new(FALSE, FALSE, sizeof(guint));
+    tracks = g_hash_table_new(g_direct_hash, g_direct_equal);
 }
 
 void plrand_destroy(void)
 {
+    g_array_free(history, TRUE);
+    g_array_free(pool, TRUE);
+    g_hash_table_unref(tracks);
+}
+
+static inline guint nth_past(guint i) { return g_array_index(history, guint, i); }
+
+static inline gboolean alive(guint id)
+{
+    return g_hash_table_lookup_extended(tracks, GUINT_TO_POINTER(id), NULL, NULL);
+}
+
+// takes a track out of the pool, if it's still in there
+static void take(guint id)
+{
+    guint slot = GPOINTER_TO_UINT(g_hash_table_lookup(tracks, GUINT_TO_POINTER(id)));
+    if(!slot)
+        return;
+
+    // the last one in the pool fills the hole
+    g_array_remove_index_fast(pool, slot - 1);
+    if(slot - 1 < pool->len)
+        g_hash_table_insert(tracks, GUINT_TO_POINTER(g_array_index(pool, guint, slot - 1)),
+                            GUINT_TO_POINTER(slot));
+    g_hash_table_insert(tracks, GUINT_TO_POINTER(id), GUINT_TO_POINTER(0));
+}
+
+static void refill(void)
+{
+    GList * ids = g_hash_table_get_keys(tracks);
+    for(GList * it = ids; it; it = g_list_next(it))
+    {
+        guint id = GPOINTER_TO_UINT(it->data);
+        g_array_append_val(pool, id);
+        g_hash_table_insert(tracks, it->data, GUINT_TO_POINTER(pool->len));
+    }
+    g_list_free(ids);
 }
 
-gint plrand_prev(gint current, gint playlist_len)
+// a random track that hasn't played yet this round, or 0 if there are no
+// tracks at all.  tries not to hand back `avoid' right after it played.
+static guint draw(guint avoid)
 {
-    g_queue_push_head(&future, GINT_TO_POINTER(current));
+    if(!pool->len)
+        refill();
+    if(!pool->len)
+        return 0;
+
+    guint i = g_random_int_range(0, pool->len);
+    if(g_array_index(pool, guint, i) == avoid && pool->len > 1)
+        i = (i + 1) % pool->len;
+
+    guint id = g_array_index(pool, guint, i);
+    take(id);
+    return id;
+}
 
-    if(g_queue_get_length(&future) > history_size)
-        g_queue_pop_tail(&future);
+static void compact(void)
+{
+    if(history->len < compact_at)
+        return;
 
-    if(!g_queue_is_empty(&past))
-        return GPOINTER_TO_INT(g_queue_pop_tail(&past));
-    else
-        return g_random_int_range(0, playlist_len);
+    guint kept = 0, new_cursor = 0;
+    for(guint i = 0; i < history->len; i++)
+    {
+        if(i == cursor)
+            new_cursor = kept;
+        if(alive(nth_past(i)))
+            g_array_index(history, guint, kept++) = nth_past(i);
+    }
+    g_array_set_size(history, kept);
+    cursor = MIN(new_cursor, kept ? kept - 1 : 0);
+    compact_at = MAX(history_compact_min, kept * 2);
 }
 
-gint plrand_next(gint current, gint playlist_len)
+// makes sure the history has us on the current track.  if the playlist
+// jumped somewhere by itself, that's a new branch: the old future goes, and
+// the track counts as played for this round.
+static void sync(guint current)
 {
-    plrand_record_past(current);
+    if(history->len && nth_past(cursor) == current)
+        return;
+
+    if(history->len)
+        g_array_set_size(history, cursor + 1);
+    take(current);
+    g_array_append_val(history, current);
+    cursor = history->len - 1;
+    compact();
+}
 
-    if(!g_queue_is_empty(&future))
-        return GPOINTER_TO_INT(g_queue_pop_head(&future));
-    else
-        return g_random_int_range(0, playlist_len);
+// the first live track after the cursor, drawing a new one if there isn't
+// one.  returns its index in the history, or -1 if there are no tracks.
+static gint upcoming(guint current)
+{
+    for(guint i = cursor + 1; i < history->len; i++)
+        if(alive(nth_past(i)))
+            return i;
+
+    guint id = draw(current);
+    if(!id)
+        return -1;
+
+    // whatever was left after the cursor was all removed tracks anyway
+    g_array_set_size(history, cursor + 1);
+    g_array_append_val(history, id);
+    return history->len - 1;
 }
 
-void plrand_record_past(gint current)
+guint plrand_next(guint current)
 {
-    g_queue_push_tail(&past, GINT_TO_POINTER(current));
+    sync(current);
+    gint i = upcoming(current);
+    if(i < 0)
+        return current;
+    cursor = i;
+    return nth_past(cursor);
+}
 
-    if(g_queue_get_length(&past) > history_size)
-        g_queue_pop_head(&past);
+// the track plrand_next will return, without moving.  if there's no future
+// yet, one is drawn now and recorded, so the next call to plrand_next agrees.
+guint plrand_peek_next(guint current)
+{
+    sync(current);
+    gint i = upcoming(current);
+    return i < 0 ? current : nth_past(i);
 }
 
-static void _shift_track_numbers(GQueue * queue, gint atleast, gint atmost, gint inc)
+guint plrand_prev(guint current)
 {
-    for(GList * it = g_queue_peek_head_link(queue); it; it = g_list_next(it))
+    sync(current);
+    for(gint i = (gint)cursor - 1; i >= 0; i--)
     {
-        if(GPOINTER_TO_INT(it->data) >= atleast &&
-           GPOINTER_TO_INT(it->data) <= atmost)
+        if(alive(nth_past(i)))
         {
-            it->data = GINT_TO_POINTER(GPOINTER_TO_INT(it->data) + inc);
+            cursor = i;
+            return nth_past(cursor);
         }
     }
+
+    // nothing behind us: make up some past, in place of the removed tracks
+    // that might have been there
+    guint id = draw(current);
+    if(!id)
+        return current;
+    g_array_remove_range(history, 0, cursor);
+    g_array_prepend_val(history, id);
+    cursor = 0;
+    return id;
 }
 
-void plrand_shift_track_numbers(gint atleast, gint atmost, gint inc)
+// called before the playlist jumps somewhere else, so that going back
+// returns here
+void plrand_record_past(guint current)
 {
-    _shift_track_numbers(&past,   atleast, atmost, inc);
-    _shift_track_numbers(&future, atleast, atmost, inc);
+    sync(current);
 }
 
-void plrand_move_track(gint src, gint dest)
+void plrand_add(guint id)
 {
-    _shift_track_numbers(&past,   src, src, dest - src);
-    _shift_track_numbers(&future, src, src, dest - src);
+    g_array_append_val(pool, id);
+    g_hash_table_insert(tracks, GUINT_TO_POINTER(id), GUINT_TO_POINTER(pool->len));
 }
 
-void plrand_forget_track(gint track)
+void plrand_remove(guint id)
 {
-    g_queue_remove_all(&past,   GINT_TO_POINTER(track));
-    g_queue_remove_all(&future, GINT_TO_POINTER(track));
+    take(id);
+    g_hash_table_remove(tracks, GUINT_TO_POINTER(id));
 }
 
 void plrand_clear(void)
 {
-    g_queue_clear(&past);
-    g_queue_clear(&future);
+    g_array_set_size(history, 0);
+    g_array_set_size(pool, 0);
+    g_hash_table_remove_all(tracks);
+    cursor = 0;
+    compact_at = history_compact_min;
 }
@@ -3,14 +3,16 @@
 
 #include <glib.h>
 
+// these all deal in playlist ids, not positions
+
 void plrand_init(void);
 void plrand_destroy(void);
-gint plrand_prev(gint current, gint playlist_len);
-gint plrand_next(gint current, gint playlist_len);
-void plrand_record_past(gint current);
-void plrand_shift_track_numbers(gint atleast, gint atmost, gint inc);
-void plrand_move_track(gint src, gint dest);
-void plrand_forget_track(gint track);
+guint plrand_prev(guint current);
+guint plrand_next(guint current);
+guint plrand_peek_next(guint current);
+void plrand_record_past(guint current);
+void plrand_add(guint id);
+void plrand_remove(guint id);
 void plrand_clear(void);
 
 #endif
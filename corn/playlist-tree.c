@@ -0,0 +1,215 @@
+#include "playlist-tree.h"
+
+#include <glib.h>
+
+// every node carries the size of its subtree, so the nth item is found by
+// walking down and a node's position by walking up.  the random priorities
+// keep the tree balanced on average without any rotations to get wrong:
+// everything is done by splitting the tree at a position and merging the
+// pieces back together in a different order.
+
+struct _PlTreeNode
+{
+    PlTreeNode * left;
+    PlTreeNode * right;
+    PlTreeNode * parent;
+    guint size;
+    guint32 priority;
+    gpointer data;
+};
+
+struct _PlTree
+{
+    PlTreeNode * root;
+};
+
+static inline guint size_of(PlTreeNode * n) { return n ? n->size : 0; }
+
+// recomputes the size of a node whose children have changed, and points the
+// children back at it
+static inline PlTreeNode * update(PlTreeNode * n)
+{
+    n->size = 1 + size_of(n->left) + size_of(n->right);
+    if(n->left)
+        n->left->parent = n;
+    if(n->right)
+        n->right->parent = n;
+    return n;
+}
+
+// everything in `a' followed by everything in `b'
+static PlTreeNode * merge(PlTreeNode * a, PlTreeNode * b)
+{
+    if(!a)
+        return b;
+    if(!b)
+        return a;
+
+    if(a->priority > b->priority)
+    {
+        a->right = merge(a->right, b);
+        return update(a);
+    }
+    b->left = merge(a, b->left);
+    return update(b);
+}
+
+// the first k items go to `l', the rest to `r'
+static void split(PlTreeNode * t, guint k, PlTreeNode ** l, PlTreeNode ** r)
+{
+    if(!t)
+    {
+        *l = *r = NULL;
+        return;
+    }
+
+    if(size_of(t->left) < k)
+    {
+        split(t->right, k - size_of(t->left) - 1, &t->right, r);
+        *l = update(t);
+    }
+    else
+    {
+        split(t->left, k, l, &t->left);
+        *r = update(t);
+    }
+}
+
+static inline void set_root(PlTree * tree, PlTreeNode * root)
+{
+    tree->root = root;
+    if(root)
+        root->parent = NULL;
+}
+
+PlTree * pltree_new(void)
+{
+    return g_new0(PlTree, 1);
+}
+
+void pltree_free(PlTree * tree)
+{
+    pltree_clear(tree);
+    g_free(tree);
+}
+
+guint pltree_length(PlTree * tree)
+{
+    return size_of(tree->root);
+}
+
+gpointer pltree_nth(PlTree * tree, guint pos)
+{
+    g_return_val_if_fail(pos < pltree_length(tree), NULL);
+
+    PlTreeNode * n = tree->root;
+    for(;;)
+    {
+        guint left = size_of(n->left);
+        if(pos < left)
+            n = n->left;
+        else if(pos == left)
+            return n->data;
+        else
+        {
+            pos -= left + 1;
+            n = n->right;
+        }
+    }
+}
+
+guint pltree_position(PlTreeNode * node)
+{
+    guint pos = size_of(node->left);
+    for(; node->parent; node = node->parent)
+        if(node == node->parent->right)
+            pos += size_of(node->parent->left) + 1;
+    return pos;
+}
+
+PlTreeNode * pltree_insert(PlTree * tree, guint pos, gpointer data)
+{
+    g_return_val_if_fail(pos <= pltree_length(tree), NULL);
+
+    PlTreeNode * node = g_new0(PlTreeNode, 1);
+    node->size = 1;
+    node->priority = g_random_int();
+    node->data = data;
+
+    // appending is the common case, and needs no split
+    if(pos == pltree_length(tree))
+    {
+        set_root(tree, merge(tree->root, node));
+        return node;
+    }
+
+    PlTreeNode * l, * r;
+    split(tree->root, pos, &l, &r);
+    set_root(tree, merge(merge(l, node), r));
+    return node;
+}
+
+gpointer pltree_remove(PlTree * tree, guint pos)
+{
+    g_return_val_if_fail(pos < pltree_length(tree), NULL);
+
+    PlTreeNode * l, * mid, * r;
+    split(tree->root, pos, &l, &r);
+    split(r, 1, &mid, &r);
+    set_root(tree, merge(l, r));
+
+    gpointer data = mid->data;
+    g_free(mid);
+    return data;
+}
+
+// takes the `count' items starting at `from' out, and puts them back so that
+// the first of them ends up at `dest'
+void pltree_move(PlTree * tree, guint from, guint count, guint dest)
+{
+    guint len = pltree_length(tree);
+    g_return_if_fail(from <= len && count <= len - from);
+    g_return_if_fail(dest <= len - count);
+
+    if(!count || from == dest)
+        return;
+
+    PlTreeNode * l, * block, * r;
+    split(tree->root, from, &l, &r);
+    split(r, count, &block, &r);
+    PlTreeNode * rest = merge(l, r);
+    split(rest, dest, &l, &r);
+    set_root(tree, merge(merge(l, block), r));
+}
+
+static void foreach_node(PlTreeNode * n, GFunc func, gpointer user_data)
+{
+    for(; n; n = n->right)
+    {
+        foreach_node(n->left, func, user_data);
+        func(n->data, user_data);
+    }
+}
+
+void pltree_foreach(PlTree * tree, GFunc func, gpointer user_data)
+{
+    foreach_node(tree->root, func, user_data);
+}
+
+static void free_node(PlTreeNode * n)
+{
+    while(n)
+    {
+        PlTreeNode * right = n->right;
+        free_node(n->left);
+        g_free(n);
+        n = right;
+    }
+}
+
+// frees the nodes only; the items are the caller's
+void pltree_clear(PlTree * tree)
+{
+    free_node(tree->root);
+    tree->root = NULL;
+}
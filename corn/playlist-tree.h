@@ -0,0 +1,28 @@
+#ifndef __corn_playlist_tree_h__
+#define __corn_playlist_tree_h__
+
+#include <glib.h>
+
+// a sequence with O(log n) indexing, insertion, removal and moving of whole
+// ranges (a treap keyed on position).  each item gets a node that knows its
+// own position, so there's no need to search for it.
+
+typedef struct _PlTree PlTree;
+typedef struct _PlTreeNode PlTreeNode;
+
+PlTree * pltree_new(void);
+void pltree_free(PlTree * tree);
+
+guint pltree_length(PlTree * tree);
+gpointer pltree_nth(PlTree * tree, guint pos);
+guint pltree_position(PlTreeNode * node);
+
+PlTreeNode * pltree_insert(PlTree * tree, guint pos, gpointer data);
+gpointer pltree_remove(PlTree * tree, guint pos);
+void pltree_move(PlTree * tree, guint from, guint count, guint dest);
+
+// in order.  the tree mustn't change while this runs.
+void pltree_foreach(PlTree * tree, GFunc func, gpointer user_data);
+void pltree_clear(PlTree * tree);
+
+#endif
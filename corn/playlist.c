@@ -1,5 +1,6 @@
 #include "playlist.h"
 #include "playlist-random.h"
+#include "playlist-tree.h"
 #include "music.h"
 #include "music-control.h"
 #include "music-metadata.h"
@@ -12,55 +13,131 @@
 #include "dbus.h"
 #include "watch.h"
 #include "db.h"
+#include "uri-intern.h"
+#include "state-playlist.h"
 
-#define playlist_mtime_never -1
-#define playlist_save_wait_time 5
+#include <stdlib.h>
 
-static GArray * playlist = NULL;
+// each entry gets an id when it's added which stays the same no matter how
+// the playlist is rearranged around it.
+typedef struct
+{
+    const gchar * uri; // interned
+    guint id;
+    PlTreeNode * node; // knows the entry's position
+} PlaylistEntry;
+
+static PlTree * playlist = NULL; // of PlaylistEntry *
 static gint position = -1;
 
-// this is set to playlist_mtime_never if current playlist has been saved to
-// disk.  otherwise, it's set to the time at which the playlist was last
-// modified.  we only trigger a save-to-disk when playlist modification
-// activity has died down for a little bit (determined by
-// playlist_save_wait_time)
-static gint playlist_mtime = playlist_mtime_never;
+// indexes for finding entries without scanning the playlist: uri -> GQueue of
+// the entries with that uri (usually just one), and id -> entry.  uris are
+// interned, so by_uri is keyed on the interned pointer itself.
+static GHashTable * by_uri = NULL;
+static GHashTable * by_id = NULL;
+static guint next_id = 1;
 
 void playlist_init(void)
 {
-    playlist = g_array_new(FALSE, FALSE, sizeof(gchar *));
+    playlist = pltree_new();
+    by_uri = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_queue_free);
+    by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
     plrand_init();
 }
 
 void playlist_destroy(void)
 {
+    gsize held;
+    gssize saved;
+    uri_intern_stats(&held, &saved);
+    g_debug("Interned uris: %" G_GSIZE_FORMAT " bytes held, %" G_GSSIZE_FORMAT " bytes saved.",
+            held, saved);
+
+    parse_cancel_all();
+    watch_destroy();
     plrand_destroy();
     playlist_clear();
-    g_array_free(playlist, TRUE);
+    pltree_free(playlist);
+    g_hash_table_unref(by_uri);
+    g_hash_table_unref(by_id);
 }
 
-inline gint     playlist_position(void) { return position; }
-inline gint     playlist_length(void)   { return playlist ? playlist->len : 0; }
-inline gboolean playlist_empty(void)    { return !playlist || !playlist->len; }
-inline gchar *  playlist_nth(gint i)    { return g_array_index(playlist, gchar *, i); }
-inline gchar *  playlist_current(void)  { return g_array_index(playlist, gchar *, position); }
-inline gboolean playlist_modified(void) { return playlist_mtime != playlist_mtime_never; }
-inline void     playlist_mark_as_flushed(void) { playlist_mtime = playlist_mtime_never; }
+static inline PlaylistEntry * nth_entry(gint i) { return pltree_nth(playlist, i); }
 
-gboolean playlist_flush_due(void)
-{
-    return playlist_modified() &&
-        main_time_counter - playlist_mtime >= playlist_save_wait_time;
-}
+inline gint     playlist_position(void) { return position; }
+inline gint     playlist_length(void)   { return playlist ? pltree_length(playlist) : 0; }
+inline gboolean playlist_empty(void)    { return !playlist_length(); }
+inline const gchar * playlist_nth(gint i)   { return nth_entry(i)->uri; }
+inline const gchar * playlist_current(void) { return nth_entry(position)->uri; }
+inline guint    playlist_nth_id(gint i) { return nth_entry(i)->id; }
 
 static void touch()
 {
-    if(main_status == CORN_RUNNING)
-        playlist_mtime = main_time_counter;
     mpris_player_emit_caps_change(mpris_player);
     mpris_tracklist_emit_track_list_change(mpris_tracklist);
 }
 
+static void index_add(PlaylistEntry * entry)
+{
+    GQueue * entries = g_hash_table_lookup(by_uri, entry->uri);
+    if(!entries)
+    {
+        entries = g_queue_new();
+        g_hash_table_insert(by_uri, (gpointer)entry->uri, entries);
+    }
+    g_queue_push_tail(entries, entry);
+    g_hash_table_insert(by_id, GUINT_TO_POINTER(entry->id), entry);
+}
+
+static void index_remove(PlaylistEntry * entry)
+{
+    GQueue * entries = g_hash_table_lookup(by_uri, entry->uri);
+    g_queue_remove(entries, entry);
+    if(g_queue_is_empty(entries))
+        g_hash_table_remove(by_uri, entry->uri);
+    g_hash_table_remove(by_id, GUINT_TO_POINTER(entry->id));
+}
+
+// position of the first entry with this uri, or -1
+gint playlist_locate(const gchar * uri)
+{
+    const gchar * interned = uri_lookup(uri);
+    GQueue * entries = interned ? g_hash_table_lookup(by_uri, interned) : NULL;
+    if(!entries)
+        return -1;
+
+    guint first = G_MAXUINT;
+    for(GList * it = g_queue_peek_head_link(entries); it; it = g_list_next(it))
+        first = MIN(first, pltree_position(((PlaylistEntry *)it->data)->node));
+    return first;
+}
+
+// appends the position of every entry with this uri to positions, an array
+// of gint, in no particular order
+void playlist_locate_all(const gchar * uri, GArray * positions)
+{
+    const gchar * interned = uri_lookup(uri);
+    GQueue * entries = interned ? g_hash_table_lookup(by_uri, interned) : NULL;
+    if(!entries)
+        return;
+
+    for(GList * it = g_queue_peek_head_link(entries); it; it = g_list_next(it))
+    {
+        gint pos = pltree_position(((PlaylistEntry *)it->data)->node);
+        g_array_append_val(positions, pos);
+    }
+}
+
+// position of the entry with this id, or -1
+gint playlist_find_id(guint id)
+{
+    PlaylistEntry * entry = g_hash_table_lookup(by_id, GUINT_TO_POINTER(id));
+    if(!entry)
+        return -1;
+
+    return pltree_position(entry->node);
+}
+
 static inline void reset_position(void)
 {
     if(playlist_empty())
@@ -69,28 +146,28 @@ static inline void reset_position(void)
         position = 0;
 }
 
-void playlist_append(gchar * path) // takes ownership of the path passed in
+// appends every file in the queue (and watches every directory), popping
+// and freeing them all
+void playlist_append_found(GQueue * found)
 {
-    g_return_if_fail(path != NULL);
-    g_return_if_fail(g_utf8_validate(path, -1, NULL));
-
-    parse_file(path);
-
-    gint len = g_queue_get_length(&found_files);
-    for(gint i = 0; i < len; i++)
+    FoundFile * ff;
+    while((ff = g_queue_pop_head(found)))
     {
-        FoundFile * ff = g_queue_pop_head(&found_files);
         if(ff->type & SNIFFED_FILE)
         {
-            g_array_append_val(playlist, ff->uri);
-            db_schedule_update(ff->uri);
+            PlaylistEntry * entry = g_new(PlaylistEntry, 1);
+            entry->uri = uri_intern(ff->uri);
+            entry->id = next_id++;
+            entry->node = pltree_insert(playlist, playlist_length(), entry);
+            index_add(entry);
+            plrand_add(entry->id);
+            db_schedule_update_stat(entry->uri, &ff->stat);
+            state_playlist_log_append(entry->uri);
         }
         else if(ff->type & SNIFFED_DIRECTORY)
-        {
             watch_dir(ff->uri);
-            g_free(ff->uri);
-        }
 
+        g_free(ff->uri);
         g_free(ff);
     }
 
@@ -98,12 +175,113 @@ void playlist_append(gchar * path) // takes ownership of the path passed in
     touch();
 }
 
+// appends uris straight from a saved snapshot.  they were sniffed when they
+// were first added, so skip that.  the db update only costs a stat for files
+// that haven't changed since they were last probed.
+void playlist_restore(const gchar ** uris, guint n)
+{
+    for(guint i = 0; i < n; i++)
+    {
+        PlaylistEntry * entry = g_new(PlaylistEntry, 1);
+        entry->uri = uri_intern(uris[i]);
+        entry->id = next_id++;
+        entry->node = pltree_insert(playlist, playlist_length(), entry);
+        index_add(entry);
+        plrand_add(entry->id);
+        db_schedule_update(entry->uri);
+    }
+
+    reset_position();
+    touch();
+}
+
+void playlist_append(gchar * path) // takes ownership of the path passed in
+{
+    g_return_if_fail(path != NULL);
+    g_return_if_fail(g_utf8_validate(path, -1, NULL));
+
+    parse_file(path);
+    playlist_append_found(&found_files);
+}
+
+// `data' is NULL, or points to a flag that's TRUE until the first track
+// the scan turns up has been started
+static void append_batch(GQueue * found, guint nfound, gboolean done, gpointer data)
+{
+    gboolean * play_first = (gboolean *)data;
+    gint first = playlist_length();
+
+    playlist_append_found(found);
+
+    if(play_first && *play_first && playlist_length() > first)
+    {
+        *play_first = FALSE;
+        playlist_seek(first);
+        if(music_playing != MUSIC_PLAYING)
+            music_play();
+    }
+
+    if(done)
+    {
+        g_free(play_first);
+        cpris_root_emit_scan_finished(cpris_root, nfound);
+    }
+    else
+        cpris_root_emit_scan_progress(cpris_root, nfound);
+}
+
+// like playlist_append, but the path is scanned on a background thread and
+// the tracks are appended a batch at a time as they turn up.  for adding
+// directories, which can take a long time to walk.  with playnow, the first
+// track it finds starts playing as soon as it's been appended.
+void playlist_append_async(gchar * path, gboolean playnow) // takes ownership of the path passed in
+{
+    g_return_if_fail(path != NULL);
+    g_return_if_fail(g_utf8_validate(path, -1, NULL));
+
+    gboolean * play_first = NULL;
+    if(playnow)
+    {
+        play_first = g_new(gboolean, 1);
+        *play_first = TRUE;
+    }
+    parse_file_async(path, append_batch, play_first);
+}
+
+// appends several paths as one background scan.  takes ownership of the
+// NULL-terminated vector and the paths in it.
+void playlist_append_many_async(gchar ** paths)
+{
+    g_return_if_fail(paths != NULL);
+
+    for(gchar ** path = paths; *path; path++)
+    {
+        if(!g_utf8_validate(*path, -1, NULL))
+        {
+            g_strfreev(paths);
+            g_return_if_reached();
+        }
+    }
+
+    parse_files_async(paths, append_batch, NULL);
+}
+
+void playlist_replace_nth(gint track, const gchar * path)
+{
+    g_return_if_fail(track >= 0 && track < playlist_length());
+    PlaylistEntry * entry = nth_entry(track);
+    index_remove(entry);
+    uri_unref(entry->uri);
+    entry->uri = uri_intern(path);
+    index_add(entry);
+    state_playlist_log_replace(track, entry->uri);
+    touch();
+}
+
 void playlist_replace_path(const gchar * path)
 {
     g_return_if_fail(!playlist_empty());
-    g_free(playlist_current());
-    g_array_index(playlist, gchar *, position) = g_strdup(path);
-    touch();
+    playlist_replace_nth(position, path);
 }
 
 void playlist_advance(gint how)
@@ -118,10 +296,11 @@ void playlist_advance(gint how)
     {
         if(setting_random_order)
         {
+            guint id = playlist_nth_id(position);
             if(how > 0)
-                position = plrand_next(position, playlist_length());
+                position = playlist_find_id(plrand_next(id));
             else if(how < 0)
-                position = plrand_prev(position, playlist_length());
+                position = playlist_find_id(plrand_prev(id));
         }
         else
         {
@@ -144,6 +323,24 @@ void playlist_advance(gint how)
     mpris_player_emit_caps_change(mpris_player);
 }
 
+// the track playlist_advance(1) would start playing, or -1 if it would stop
+gint playlist_peek_next(void)
+{
+    if(playlist_empty())
+        return -1;
+
+    if(setting_repeat_track)
+        return position;
+
+    if(setting_random_order)
+        return playlist_find_id(plrand_peek_next(playlist_nth_id(position)));
+
+    if(position + 1 < playlist_length())
+        return position + 1;
+
+    return setting_loop_at_end ? 0 : -1;
+}
+
 void playlist_seek(gint track)
 {
     if(G_UNLIKELY(track < 0)) return;
@@ -151,7 +348,8 @@ void playlist_seek(gint track)
 
     gint was_playing = music_playing;
 
-    plrand_record_past(position);
+    if(position >= 0)
+        plrand_record_past(playlist_nth_id(position));
 
     position = track;
 
@@ -167,24 +365,38 @@ void playlist_seek(gint track)
     mpris_player_emit_caps_change(mpris_player);
 }
 
+static void free_entry(PlaylistEntry * entry)
+{
+    db_schedule_remove(entry->uri);
+    uri_unref(entry->uri);
+    g_free(entry);
+}
+
 void playlist_clear(void)
 {
     music_stop();
 
-    for(gint i = 0; i < playlist_length(); i++)
-    {
-        db_schedule_remove(playlist_nth(i));
-        g_free(playlist_nth(i));
-    }
-
-    g_array_set_size(playlist, 0);
+    pltree_foreach(playlist, (GFunc)free_entry, NULL);
+    pltree_clear(playlist);
+    g_hash_table_remove_all(by_uri);
+    g_hash_table_remove_all(by_id);
 
     plrand_clear();
+    state_playlist_log_clear();
 
     reset_position();
     touch();
 }
 
+static void remove_entry(gint track)
+{
+    PlaylistEntry * entry = pltree_remove(playlist, track);
+    index_remove(entry);
+    plrand_remove(entry->id);
+    free_entry(entry);
+    state_playlist_log_remove(track);
+}
+
 void playlist_remove(gint track)
 {
     if(G_UNLIKELY(track < 0)) return;
@@ -196,13 +408,7 @@ void playlist_remove(gint track)
     if(track < position)
         position--;
 
-    db_schedule_remove(playlist_nth(track));
-
-    g_free(playlist_nth(track));
-    g_array_remove_index(playlist, track); // O(n)
-
-    plrand_shift_track_numbers(track + 1, playlist_length() - 1, -1);
-    plrand_forget_track(track);
+    remove_entry(track);
 
     // if we're still in the same spot, there was no track to advance to.  set
     // to track 0, or if we're removing last song, set to -1.
@@ -212,30 +418,88 @@ void playlist_remove(gint track)
     touch();
 }
 
-void playlist_move(gint track, gint dest)
+static gint compare_descending(gconstpointer a, gconstpointer b)
 {
-    // XXX segfaults
-    if(G_UNLIKELY(track == dest)) return;
-    if(G_UNLIKELY(track < 0)) return;
-    if(G_UNLIKELY(track >= playlist_length())) return;
+    return *(const gint *)b - *(const gint *)a;
+}
 
-    if(dest > track)
-        plrand_shift_track_numbers(track+1, dest-1, -1);
-    else if(dest < track)
-        plrand_shift_track_numbers(dest, track-1, +1);
+// removes a whole selection of tracks at once, telling everyone only once.
+// if the current track goes, whatever followed it takes its place, the same
+// as playlist_remove does outside of random order.
+void playlist_remove_many(const gint * tracks, guint n)
+{
+    // from the back, so the positions still to go stay put
+    gint * sorted = g_memdup(tracks, n * sizeof(gint));
+    qsort(sorted, n, sizeof(gint), compare_descending);
 
-    plrand_move_track(track, dest);
+    gint was_playing = music_playing;
+    gboolean lost_current = FALSE;
+    guint removed = 0;
 
-    gchar * item = playlist_nth(track);
-    g_array_insert_val(playlist, (dest > track ? dest+1 : dest), item); // O(n)
-    g_array_remove_index(playlist, track); // O(n)
+    for(guint i = 0; i < n; i++)
+    {
+        gint track = sorted[i];
+        if(track < 0 || track >= playlist_length())
+            continue;
+        if(i && track == sorted[i-1])
+            continue;
 
-    if(track == position)
-        position = dest;
-    else if(track < position && dest > position)
-        position--;
-    else if(track > position && dest <= position)
-        position++;
+        if(track == position)
+        {
+            music_stop();
+            lost_current = TRUE;
+        }
+        else if(track < position)
+            position--;
+
+        remove_entry(track);
+        removed++;
+    }
+    g_free(sorted);
+
+    if(!removed)
+        return;
+
+    if(lost_current)
+    {
+        if(position >= playlist_length())
+            position = playlist_empty() ? -1 : 0;
+        if(was_playing == MUSIC_PLAYING && !playlist_empty())
+            music_play();
+        mpris_player_emit_track_change(mpris_player);
+    }
+
+    reset_position();
+    touch();
+}
+
+// moves the `count' tracks starting at `start' so that the first of them
+// ends up at `dest'
+void playlist_move_range(gint start, gint count, gint dest)
+{
+    if(G_UNLIKELY(count <= 0 || start == dest)) return;
+    if(G_UNLIKELY(start < 0 || dest < 0)) return;
+    if(G_UNLIKELY(start > playlist_length() - count)) return;
+    if(G_UNLIKELY(dest > playlist_length() - count)) return;
+
+    pltree_move(playlist, start, count, dest);
+    state_playlist_log_move(start, count, dest);
+
+    if(position >= start && position < start + count)
+        position = dest + (position - start);
+    else
+    {
+        // where it was with the range taken out, then with it put back
+        if(position >= start + count)
+            position -= count;
+        if(position >= dest)
+            position += count;
+    }
 
     touch();
 }
+
+void playlist_move(gint track, gint dest)
+{
+    playlist_move_range(track, 1, dest);
+}
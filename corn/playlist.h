@@ -9,19 +9,27 @@ void playlist_destroy(void);
 gint playlist_position(void);
 gint playlist_length(void);
 gboolean playlist_empty(void);
-gchar * playlist_nth(gint i);
-gchar * playlist_current(void);
-
-gboolean playlist_modified(void);
-gboolean playlist_flush_due(void);
-void playlist_mark_as_flushed(void);
+const gchar * playlist_nth(gint i);
+const gchar * playlist_current(void);
+guint playlist_nth_id(gint i);
+gint playlist_locate(const gchar * uri);
+void playlist_locate_all(const gchar * uri, GArray * positions);
+gint playlist_find_id(guint id);
 
 void playlist_append(gchar * path);
+void playlist_append_found(GQueue * found);
+void playlist_restore(const gchar ** uris, guint n);
+void playlist_append_async(gchar * path, gboolean playnow);
+void playlist_append_many_async(gchar ** paths);
 void playlist_replace_path(const gchar * path);
+void playlist_replace_nth(gint track, const gchar * path);
 void playlist_advance(gint how);
+gint playlist_peek_next(void);
 void playlist_seek(gint track);
 void playlist_clear(void);
 void playlist_remove(gint track);
 void playlist_move(gint track, gint dest);
+void playlist_remove_many(const gint * tracks, guint n);
+void playlist_move_range(gint start, gint count, gint dest);
 
 #endif
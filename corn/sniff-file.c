@@ -10,76 +10,265 @@
 
 gboolean sniff_looks_like_uri(const gchar * path)
 {
-    static GRegex * uri_pattern = NULL;
-    if(!uri_pattern)
-        uri_pattern = g_regex_new("^[a-z0-9+.-]+:",
-            G_REGEX_CASELESS | G_REGEX_OPTIMIZE, 0, NULL);
-    return g_regex_match(uri_pattern, path, 0, NULL);
+    // background scans call this too, so set it up exactly once
+    static volatile gsize uri_pattern = 0;
+    if(g_once_init_enter(&uri_pattern))
+        g_once_init_leave(&uri_pattern, (gsize)g_regex_new("^[a-z0-9+.-]+:",
+            G_REGEX_CASELESS | G_REGEX_OPTIMIZE, 0, NULL));
+    return g_regex_match((GRegex *)uri_pattern, path, 0, NULL);
 }
 
-static FoundFile * found_file_new(gchar * uri, gint type)
+void sniff_file_stat_from_info(GFileInfo * info, FileStat * stat)
 {
-    FoundFile * ff = g_new(FoundFile, 1);
+    stat->size = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_STANDARD_SIZE);
+    stat->mtime = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+    stat->inode = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_UNIX_INODE);
+}
+
+static FoundFile * found_file_new(gchar * uri, gint type, const FileStat * stat)
+{
+    FoundFile * ff = g_new0(FoundFile, 1);
     ff->uri = uri;
     ff->type = type;
+    if(stat)
+        ff->stat = *stat;
     return ff;
 }
 
-static FoundFile * _sniff_fallback_dumb_and_slow(const gchar * path, GFile * file)
+// what a file extension says about a file.  FORMAT_UNSURE means the name
+// alone doesn't settle it and the first few bytes have to be looked at.
+enum
+{
+    FORMAT_UNSURE = 0,
+    FORMAT_AUDIO,
+    FORMAT_M3U,
+    FORMAT_PLS,
+    FORMAT_NOT_AUDIO,
+};
+
+typedef struct
+{
+    const gchar * ext;
+    gint format;
+} SniffExtension;
+
+static const SniffExtension extensions[] = {
+    { "mp3",  FORMAT_AUDIO },
+    { "mp2",  FORMAT_AUDIO },
+    { "ogg",  FORMAT_AUDIO },
+    { "oga",  FORMAT_AUDIO },
+    { "m4a",  FORMAT_AUDIO },
+    { "aac",  FORMAT_AUDIO },
+    { "ape",  FORMAT_AUDIO },
+    { "mpc",  FORMAT_AUDIO },
+    { "wv",   FORMAT_AUDIO },
+    { "wav",  FORMAT_AUDIO },
+    { "pcm",  FORMAT_AUDIO },
+    { "wma",  FORMAT_AUDIO },
+    { "ra",   FORMAT_AUDIO },
+    { "ram",  FORMAT_AUDIO },
+    { "flac", FORMAT_AUDIO },
+    { "aif",  FORMAT_AUDIO },
+    { "aiff", FORMAT_AUDIO },
+    { "ac3",  FORMAT_AUDIO },
+    { "mod",  FORMAT_AUDIO },
+    { "s3m",  FORMAT_AUDIO },
+    { "xm",   FORMAT_AUDIO },
+    { "it",   FORMAT_AUDIO },
+
+    { "m3u",  FORMAT_M3U },
+    { "pls",  FORMAT_PLS },
+
+    // the things that usually sit next to an album
+    { "jpg",  FORMAT_NOT_AUDIO },
+    { "jpeg", FORMAT_NOT_AUDIO },
+    { "png",  FORMAT_NOT_AUDIO },
+    { "gif",  FORMAT_NOT_AUDIO },
+    { "bmp",  FORMAT_NOT_AUDIO },
+    { "nfo",  FORMAT_NOT_AUDIO },
+    { "txt",  FORMAT_NOT_AUDIO },
+    { "cue",  FORMAT_NOT_AUDIO },
+    { "log",  FORMAT_NOT_AUDIO },
+    { "sfv",  FORMAT_NOT_AUDIO },
+    { "md5",  FORMAT_NOT_AUDIO },
+    { "pdf",  FORMAT_NOT_AUDIO },
+    { "db",   FORMAT_NOT_AUDIO },
+    { "ini",  FORMAT_NOT_AUDIO },
+    { "url",  FORMAT_NOT_AUDIO },
+    { "htm",  FORMAT_NOT_AUDIO },
+    { "html", FORMAT_NOT_AUDIO },
+    { "par2", FORMAT_NOT_AUDIO },
+    { "accurip", FORMAT_NOT_AUDIO },
+};
+
+// signatures found at the start of audio files.  mpeg audio without an id3
+// tag has no signature as such, so frame syncs are checked separately.
+typedef struct
+{
+    gsize offset;
+    const gchar * bytes;
+    gsize len;
+} SniffMagic;
+
+#define magic(offset, bytes) { offset, bytes, sizeof(bytes) - 1 }
+
+static const SniffMagic audio_magic[] = {
+    magic(0, "ID3"),
+    magic(0, "fLaC"),
+    magic(0, "OggS"),
+    magic(8, "WAVE"),  // after "RIFF" and the chunk size
+    magic(4, "ftyp"),
+    magic(0, "MAC "),  // monkey's audio
+    magic(0, "MPCK"),  // musepack sv8
+    magic(0, "MP+"),   // musepack sv7
+    magic(0, "wvpk"),
+    magic(8, "AIFF"),  // after "FORM" and the chunk size
+    magic(8, "AIFC"),
+    magic(0, ".ra\xfd"),
+    magic(0, ".RMF"),
+    magic(0, "\x30\x26\xb2\x75\x8e\x66\xcf\x11"), // asf, for wma
+    magic(0, "\x0b\x77"), // ac3
+};
+
+// signatures of the things that turn up next to music but aren't.  only
+// these get a file turned away; anything unrecognised is left to xine, which
+// plays far more than we could list here.
+static const SniffMagic other_magic[] = {
+    magic(0, "\xff\xd8\xff"),     // jpeg
+    magic(0, "\x89PNG"),
+    magic(0, "GIF8"),
+    magic(0, "%PDF"),
+    magic(0, "PK\x03\x04"),       // zip
+};
+
+#define sniff_header_size 16
+
+static gint format_from_extension(const gchar * path)
+{
+    const gchar * dot = strrchr(path, '.');
+    if(!dot || strchr(dot, '/'))
+        return FORMAT_UNSURE;
+
+    for(guint i = 0; i < G_N_ELEMENTS(extensions); i++)
+        if(!g_ascii_strcasecmp(dot + 1, extensions[i].ext))
+            return extensions[i].format;
+
+    return FORMAT_UNSURE;
+}
+
+static gboolean matches(const SniffMagic * table, guint n, const guchar * buf, gsize len)
 {
-    GFileInfo * info = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_TYPE,
-            G_FILE_QUERY_INFO_NONE, NULL, NULL);
-    if(info)
+    for(guint i = 0; i < n; i++)
     {
-        guint type = g_file_info_get_attribute_uint32(info,
-                G_FILE_ATTRIBUTE_STANDARD_TYPE);
-        g_object_unref(info);
-        if(type == G_FILE_TYPE_DIRECTORY)
-            return found_file_new(g_file_get_uri(file), SNIFFED_DIRECTORY);
+        const SniffMagic * m = &table[i];
+        if(len >= m->offset + m->len && !memcmp(buf + m->offset, m->bytes, m->len))
+            return TRUE;
     }
+    return FALSE;
+}
 
-    // i guess it's just some file.  we'll find out later when we try to play it.
-    return found_file_new(g_file_get_uri(file), SNIFFED_FILE);
+// nfo, cue, log and friends: nothing but printable text
+static gboolean looks_like_text(const guchar * buf, gsize len)
+{
+    for(gsize i = 0; i < len; i++)
+        if(!g_ascii_isprint(buf[i]) && !g_ascii_isspace(buf[i]))
+            return FALSE;
+    return len > 0;
 }
 
-FoundFile * sniff_file(const gchar * path, GFile * file)
+static gint format_from_header(const guchar * buf, gsize len)
 {
-    gsize pathlen = strlen(path);
+    if(matches(audio_magic, G_N_ELEMENTS(audio_magic), buf, len))
+        return FORMAT_AUDIO;
+
+    // an mpeg audio (or adts aac) frame sync: eleven bits set
+    if(len >= 2 && buf[0] == 0xff && (buf[1] & 0xe0) == 0xe0)
+        return FORMAT_AUDIO;
 
-    if(pathlen < 5)
+    if(len >= 7 && !memcmp(buf, "#EXTM3U", 7))
+        return FORMAT_M3U;
+    if(len >= 10 && !g_ascii_strncasecmp((const gchar *)buf, "[playlist]", 10))
+        return FORMAT_PLS;
+
+    if(matches(other_magic, G_N_ELEMENTS(other_magic), buf, len) || looks_like_text(buf, len))
+        return FORMAT_NOT_AUDIO;
+
+    return FORMAT_AUDIO;
+}
+
+// reads the start of a local file to see what it is.  anything that isn't
+// local is left for xine to figure out, since opening it could mean a trip
+// over the network.
+static gint format_from_content(GFile * file)
+{
+    if(!g_file_is_native(file))
+        return FORMAT_AUDIO;
+
+    GFileInputStream * in = g_file_read(file, NULL, NULL);
+    if(!in)
+        return FORMAT_AUDIO; // let the player be the one to complain
+
+    guchar buf[sniff_header_size];
+    gssize len = g_input_stream_read(G_INPUT_STREAM(in), buf, sizeof(buf), NULL, NULL);
+    g_object_unref(in);
+
+    if(len < 0)
+        return FORMAT_AUDIO;
+    return format_from_header(buf, len);
+}
+
+static FoundFile * found_format(GFile * file, gint format, const FileStat * stat)
+{
+    switch(format)
     {
-        // screw it, can't guess based on name
-        return _sniff_fallback_dumb_and_slow(path, file);
+    case FORMAT_AUDIO:
+        return found_file_new(g_file_get_uri(file), SNIFFED_FILE, stat);
+    case FORMAT_M3U:
+        return found_file_new(NULL, SNIFFED_M3U, NULL);
+    case FORMAT_PLS:
+        return found_file_new(NULL, SNIFFED_PLS, NULL);
+    default:
+        return found_file_new(NULL, SNIFFED_REJECTED, NULL);
     }
+}
+
+// known_type and known_stat are whatever the caller already knows about the
+// file, or G_FILE_TYPE_UNKNOWN and NULL
+FoundFile * sniff_file(const gchar * path, GFile * file, GFileType known_type,
+                       const FileStat * known_stat)
+{
+    gint format = format_from_extension(path);
 
-    // to match these we want at least one character, followed by a dot,
-    // followed by the file extension
-    if((pathlen >= 5 &&
-        (!g_ascii_strcasecmp(path+pathlen-4, ".mp3") ||
-         !g_ascii_strcasecmp(path+pathlen-4, ".ogg") ||
-         !g_ascii_strcasecmp(path+pathlen-4, ".m4a") ||
-         !g_ascii_strcasecmp(path+pathlen-4, ".ape") ||
-         !g_ascii_strcasecmp(path+pathlen-4, ".mpc") ||
-         !g_ascii_strcasecmp(path+pathlen-4, ".wav") ||
-         !g_ascii_strcasecmp(path+pathlen-4, ".pcm") ||
-         !g_ascii_strcasecmp(path+pathlen-4, ".wma") ||
-         !g_ascii_strcasecmp(path+pathlen-4, ".ram")))
-       ||
-       (pathlen >= 6 &&
-        (!g_ascii_strcasecmp(path+pathlen-5, ".flac") ||
-         !g_ascii_strcasecmp(path+pathlen-5, ".aiff"))))
+    // a path nobody has looked at yet could be a directory with a dot in its
+    // name, so ask first.  remote files with a familiar extension are taken
+    // at their word rather than paying for a trip over the network.
+    FileStat stat = { 0, 0, 0 };
+    if(known_type == G_FILE_TYPE_UNKNOWN &&
+       (format == FORMAT_UNSURE || g_file_is_native(file)))
     {
-        // looks like a boring media file with predictable file extension
-        return found_file_new(g_file_get_uri(file), SNIFFED_FILE);
+        GFileInfo * info = g_file_query_info(file, SNIFF_FILE_ATTRIBUTES,
+                G_FILE_QUERY_INFO_NONE, NULL, NULL);
+        if(info)
+        {
+            known_type = g_file_info_get_attribute_uint32(info,
+                    G_FILE_ATTRIBUTE_STANDARD_TYPE);
+            sniff_file_stat_from_info(info, &stat);
+            g_object_unref(info);
+            known_stat = &stat;
+        }
     }
 
-    // maybe a playlist?
+    if(known_type == G_FILE_TYPE_DIRECTORY)
+        return found_file_new(g_file_get_uri(file), SNIFFED_DIRECTORY, known_stat);
 
-    if(!g_ascii_strcasecmp(path+pathlen-4, ".m3u"))
-        return found_file_new(NULL, SNIFFED_M3U);
+    // a familiar extension is enough, and costs no more i/o
+    if(format != FORMAT_UNSURE)
+        return found_format(file, format, known_stat);
 
-    if(!g_ascii_strcasecmp(path+pathlen-4, ".pls"))
-        return found_file_new(NULL, SNIFFED_PLS);
+    // streams and anything else we couldn't ask about go through untouched;
+    // we'll find out later when we try to play it
+    if(known_type != G_FILE_TYPE_REGULAR)
+        return found_file_new(g_file_get_uri(file), SNIFFED_FILE, known_stat);
 
-    return _sniff_fallback_dumb_and_slow(path, file);
+    return found_format(file, format_from_content(file), known_stat);
 }
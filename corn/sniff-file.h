@@ -9,14 +9,33 @@
 #define SNIFFED_PLAYLIST   (1<<2)
 #define SNIFFED_M3U       ((1<<3)|SNIFFED_PLAYLIST)
 #define SNIFFED_PLS       ((1<<4)|SNIFFED_PLAYLIST)
+#define SNIFFED_REJECTED   (1<<5) // not something we can play
+
+// what the filesystem said about a file when it was found, so that nobody
+// further down the line has to ask again.  all zero when unknown; an inode of
+// zero means the rest can't be trusted either.
+typedef struct
+{
+    gint64 size;
+    gint64 mtime;
+    gint64 inode;
+} FileStat;
 
 typedef struct
 {
     gchar * uri;
     guint type;
+    FileStat stat;
 } FoundFile;
 
-FoundFile * sniff_file(const gchar * path, GFile * file);
+// the attributes to ask for when enumerating, to fill in a FileStat
+#define SNIFF_FILE_ATTRIBUTES \
+    G_FILE_ATTRIBUTE_STANDARD_TYPE "," G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+    G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_UNIX_INODE
+
+void sniff_file_stat_from_info(GFileInfo * info, FileStat * stat);
+FoundFile * sniff_file(const gchar * path, GFile * file, GFileType known_type,
+                       const FileStat * known_stat);
 gboolean sniff_looks_like_uri(const gchar * path);
 
 #endif
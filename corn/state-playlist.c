@@ -6,77 +6,504 @@
 #include "playlist.h"
 #include "state.h"
 #include "parsefile.h"
+#include "sniff-file.h"
+#include "uri-intern.h"
 
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// the playlist is kept on disk as a snapshot (playlist.snapshot) plus a
+// journal of every change made since (playlist.journal), one record per line:
+//
+//   a <uri>                   append
+//   r <track>                 remove
+//   m <track> <dest> [count]  move (count tracks, 1 if left out)
+//   s <track> <uri>           replace
+//   c                         clear
+//
+// records pile up in memory and are written and synced once a second by the
+// save thread.  once the journal gets big compared to the snapshot, the save
+// thread writes a fresh snapshot and empties the journal.
+//
+// each compaction bumps a generation number, which is recorded on the first
+// line of both files.  the journal is only replayed over a snapshot of the
+// same generation, so a crash between writing the snapshot and emptying the
+// journal can't apply the same changes twice.
+//
+// the snapshot is a binary file that gets mapped at startup and handed to the
+// playlist as is, since going through parse_file would sniff every entry.  it
+// is native-endian; it's a cache for this machine, not an interchange format.
+// playlist.m3u is still written next to it for other programs, and read at
+// startup only when there's no usable snapshot, as left by older versions.
+//
+//   SnapshotHeader
+//   guint32 offsets[count]        where each uri starts, within the strings
+//   gchar strings[strings_size]   the uris, each ending in a nul
+
+#define snapshot_name "playlist.snapshot"
+#define export_name "playlist.m3u"
+#define journal_name "playlist.journal"
+
+#define snapshot_magic "CORNPLS"
+#define snapshot_version 1
+
+typedef struct
+{
+    gchar magic[8];
+    guint32 version;
+    guint32 generation;
+    guint32 count;
+    guint32 strings_size;
+} SnapshotHeader;
+
+// compact once the journal is at least this big, and at least half the size
+// of the snapshot
+#define journal_compact_min (256 * 1024)
+
+enum
+{
+    JOB_APPEND,
+    JOB_COMPACT
+};
+
+typedef struct
+{
+    gint kind;
+    GString * records; // JOB_APPEND, or for JOB_COMPACT what hadn't been journalled yet
+    const gchar ** uris; // JOB_COMPACT, interned and ref'd for the thread
+    guint nuris;
+    guint generation;
+    gsize journalled; // JOB_COMPACT: the journal it empties, in bytes
+    gboolean ok;      // JOB_COMPACT: set by the thread
+} SaveJob;
 
 static GThreadPool * pool;
+static GAsyncQueue * finished; // compactions whose uris need unreffing
+static GString * pending = NULL;
+static guint generation = 0;
+static gsize journal_bytes = 0;
+static gsize snapshot_bytes = 0;
+
+// save thread only
+static gint journal_fd = -1;
+
+static gboolean journal_open(void)
+{
+    if(journal_fd != -1)
+        return TRUE;
+
+    gchar * path = state_file_path(journal_name);
+    journal_fd = g_open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    g_free(path);
+
+    if(journal_fd == -1)
+        g_printerr("%s (%s).\n", _("Couldn't open playlist journal for writing"), g_strerror(errno));
+    return journal_fd != -1;
+}
+
+static void write_all(gint fd, const gchar * buf, gsize len)
+{
+    while(len)
+    {
+        ssize_t ret = write(fd, buf, len);
+        if(ret == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            g_printerr("%s (%s).\n", _("Couldn't write playlist journal"), g_strerror(errno));
+            return;
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static void save_journal(GString * records)
+{
+    if(journal_open())
+    {
+        write_all(journal_fd, records->str, records->len);
+        fdatasync(journal_fd);
+    }
+    g_string_free(records, TRUE);
+}
+
+static void write_snapshot(FILE * f, SaveJob * job)
+{
+    SnapshotHeader header = { snapshot_magic, snapshot_version, job->generation, job->nuris, 0 };
+    guint32 * offsets = g_new(guint32, job->nuris);
+    for(guint i = 0; i < job->nuris; i++)
+    {
+        offsets[i] = header.strings_size;
+        header.strings_size += strlen(job->uris[i]) + 1;
+    }
+
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(offsets, sizeof(guint32), job->nuris, f);
+    for(guint i = 0; i < job->nuris; i++)
+        fwrite(job->uris[i], 1, strlen(job->uris[i]) + 1, f);
+    g_free(offsets);
+}
+
+static void write_export(FILE * f, SaveJob * job)
+{
+    for(guint i = 0; i < job->nuris; i++)
+    {
+        fputs(job->uris[i], f);
+        fputc('\n', f);
+    }
+}
 
-static void save_playlist(GString * pldata)
+// write to a temporary file and rename it over the old one, so that whatever
+// is on disk is always complete
+static gboolean replace_file(const gchar * name, void (* writer)(FILE *, SaveJob *), SaveJob * job)
 {
-    FILE * f = state_file_open("playlist.m3u", "w");
-    if(f)
+    gchar * path = state_file_path(name);
+    gchar * tmppath = g_strconcat(path, ".tmp", NULL);
+    gboolean ok = FALSE;
+
+    FILE * f = g_fopen(tmppath, "wb");
+    if(!f)
+        g_printerr("%s (%s).\n", _("Couldn't open playlist file for writing"), g_strerror(errno));
+    else
     {
-        fputs(pldata->str, f);
+        writer(f, job);
+        ok = !ferror(f) && !fflush(f) && !fsync(fileno(f));
         fclose(f);
+
+        if(!ok || g_rename(tmppath, path))
+        {
+            g_printerr("%s (%s).\n", _("Couldn't save playlist file"), g_strerror(errno));
+            g_unlink(tmppath);
+            ok = FALSE;
+        }
+    }
+
+    g_free(tmppath);
+    g_free(path);
+    return ok;
+}
+
+static gboolean save_snapshot(SaveJob * job)
+{
+    if(!replace_file(snapshot_name, write_snapshot, job))
+        return FALSE;
+
+    // the snapshot now covers everything journalled so far
+    if(journal_open())
+    {
+        gchar * header = g_strdup_printf("g %u\n", job->generation);
+        if(ftruncate(journal_fd, 0))
+            g_printerr("%s (%s).\n", _("Couldn't empty playlist journal"), g_strerror(errno));
+        write_all(journal_fd, header, strlen(header));
+        fdatasync(journal_fd);
+        g_free(header);
+    }
+
+    replace_file(export_name, write_export, job);
+    return TRUE;
+}
+
+static void save_threadfunc(gpointer data, gpointer user_data)
+{
+    SaveJob * job = (SaveJob *)data;
+    if(job->kind == JOB_APPEND)
+    {
+        save_journal(job->records);
+        g_free(job);
     }
     else
-        g_printerr("%s (%s).\n", _("Couldn't open playlist file for writing"), g_strerror(errno));
-    g_string_free(pldata, TRUE);
+    {
+        // without a new snapshot the old one and its journal still stand, so
+        // the changes it would have covered go on the end of the journal
+        // like any others
+        job->ok = save_snapshot(job);
+        if(job->ok)
+            g_string_free(job->records, TRUE);
+        else
+            save_journal(job->records);
+        job->records = NULL;
+        g_async_queue_push(finished, job);
+    }
 }
 
-static void save_playlist_threadfunc(gpointer data, gpointer user_data)
+static void push_job(SaveJob * job)
 {
-    save_playlist((GString *)data);
+    GError * error = NULL;
+    g_thread_pool_push(pool, job, &error);
+    if(error)
+        g_error("%s (%s).\n", _("Couldn't push thread to save playlist to disk"), error->message);
 }
 
-static GString * generate_playlist_data(void)
+static void reap_finished(void)
 {
-    GString * s = g_string_new("");
-    for(gint i = 0; i < playlist_length(); i++)
-    {   
-        g_string_append(s, playlist_nth(i));
-        g_string_append_c(s, '\n');
+    SaveJob * job;
+    while((job = g_async_queue_try_pop(finished)))
+    {
+        if(!job->ok)
+            journal_bytes += job->journalled;
+        for(guint i = 0; i < job->nuris; i++)
+            uri_unref(job->uris[i]);
+        g_free(job->uris);
+        g_free(job);
     }
-    return s;
 }
 
-void state_playlist_init(void)
+static void compact(void)
+{
+    SaveJob * job = g_new0(SaveJob, 1);
+    job->kind = JOB_COMPACT;
+    job->nuris = playlist_length();
+    job->uris = g_new(const gchar *, job->nuris);
+    job->generation = ++generation;
+
+    snapshot_bytes = 0;
+    for(guint i = 0; i < job->nuris; i++)
+    {
+        job->uris[i] = uri_ref(playlist_nth(i));
+        snapshot_bytes += strlen(job->uris[i]) + 1;
+    }
+
+    // the snapshot will have whatever hasn't been written out yet, but the
+    // thread still needs it in case writing the snapshot fails
+    job->records = pending;
+    job->journalled = journal_bytes + pending->len;
+    pending = g_string_new("");
+    journal_bytes = 0;
+
+    push_job(job);
+}
+
+// recording changes
+
+static void record(const gchar * format, ...)
+{
+    // loading the playlist at startup, and tearing it down at exit, aren't
+    // changes anyone needs to remember
+    if(main_status != CORN_RUNNING)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    g_string_append_vprintf(pending, format, args);
+    va_end(args);
+}
+
+void state_playlist_log_append(const gchar * uri)        { record("a %s\n", uri); }
+void state_playlist_log_remove(gint track)               { record("r %d\n", track); }
+void state_playlist_log_replace(gint track, const gchar * uri) { record("s %d %s\n", track, uri); }
+void state_playlist_log_clear(void)                      { record("c\n"); }
+
+void state_playlist_log_move(gint start, gint count, gint dest)
+{
+    // single tracks keep the short form
+    if(count == 1)
+        record("m %d %d\n", start, dest);
+    else
+        record("m %d %d %d\n", start, dest, count);
+}
+
+// startup
+
+static gboolean snapshot_valid(const gchar * data, gsize length)
+{
+    const SnapshotHeader * header = (const SnapshotHeader *)data;
+    if(length < sizeof(SnapshotHeader) ||
+       memcmp(header->magic, snapshot_magic, sizeof(header->magic)) ||
+       header->version != snapshot_version ||
+       header->count > (length - sizeof(SnapshotHeader)) / sizeof(guint32) ||
+       length - sizeof(SnapshotHeader) - header->count * sizeof(guint32) != header->strings_size)
+        return FALSE;
+
+    const guint32 * offsets = (const guint32 *)(header + 1);
+    const gchar * strings = (const gchar *)(offsets + header->count);
+    if(header->strings_size && strings[header->strings_size - 1] != '\0')
+        return FALSE;
+    for(guint32 i = 0; i < header->count; i++)
+        if(offsets[i] >= header->strings_size)
+            return FALSE;
+    return TRUE;
+}
+
+static gboolean load_snapshot(void)
 {
-    gchar * playlist_filename = g_build_filename(g_get_user_data_dir(), main_instance_name, "playlist.m3u", NULL);
+    gchar * path = state_file_path(snapshot_name);
+    GMappedFile * map = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if(!map)
+        return FALSE;
+
+    const gchar * data = g_mapped_file_get_contents(map);
+    gsize length = g_mapped_file_get_length(map);
+    gboolean valid = snapshot_valid(data, length);
+
+    if(valid)
+    {
+        const SnapshotHeader * header = (const SnapshotHeader *)data;
+        const guint32 * offsets = (const guint32 *)(header + 1);
+        const gchar * strings = (const gchar *)(offsets + header->count);
+
+        const gchar ** uris = g_new(const gchar *, header->count);
+        for(guint32 i = 0; i < header->count; i++)
+            uris[i] = strings + offsets[i];
+        playlist_restore(uris, header->count);
+        g_free(uris);
+
+        generation = header->generation;
+        snapshot_bytes = header->strings_size;
+    }
+    else
+        g_warning("Ignoring damaged or outdated playlist snapshot.");
+
+    g_mapped_file_free(map);
+    return valid;
+}
+
+// the m3u from older versions, or from a snapshot that couldn't be used.
+// it has no generation, so no journal is replayed over it.
+static void load_export(void)
+{
+    gchar * playlist_filename = state_file_path(export_name);
     playlist_append(playlist_filename);
     g_free(playlist_filename);
 
+    for(gint i = 0; i < playlist_length(); i++)
+        snapshot_bytes += strlen(playlist_nth(i)) + 1;
+}
+
+static void replay_flush_appends(GQueue * appends)
+{
+    if(!g_queue_is_empty(appends))
+        playlist_append_found(appends);
+}
+
+static void replay(gchar ** lines)
+{
+    GQueue appends = G_QUEUE_INIT;
+    gint track, dest, count, skip, n;
+
+    // the last element is whatever followed the final newline: nothing, or a
+    // record that was cut off mid-write
+    for(gint i = 1; lines[i] && lines[i+1]; i++)
+    {
+        gchar * line = lines[i];
+
+        if(line[0] == 'a' && line[1] == ' ')
+        {
+            FoundFile * ff = g_new0(FoundFile, 1);
+            ff->uri = g_strdup(line + 2);
+            ff->type = SNIFFED_FILE;
+            g_queue_push_tail(&appends, ff);
+            continue;
+        }
+
+        replay_flush_appends(&appends);
+
+        if(sscanf(line, "r %d", &track) == 1)
+            playlist_remove(track);
+        else if((n = sscanf(line, "m %d %d %d", &track, &dest, &count)) >= 2)
+            playlist_move_range(track, n == 3 ? count : 1, dest);
+        else if(sscanf(line, "s %d %n", &track, &skip) == 1 && line[skip])
+            playlist_replace_nth(track, line + skip);
+        else if(!strcmp(line, "c"))
+            playlist_clear();
+        else
+            g_warning("Ignoring bad playlist journal record: %s", line);
+    }
+
+    replay_flush_appends(&appends);
+}
+
+// replays the journal if it belongs to the snapshot just loaded, and makes
+// sure it's ready to be appended to either way
+static void load_journal(void)
+{
+    gchar * path = state_file_path(journal_name);
+    gchar * buf = NULL;
+    gboolean valid = FALSE;
+
+    if(g_file_get_contents(path, &buf, &journal_bytes, NULL))
+    {
+        gchar ** lines = g_strsplit(buf, "\n", 0);
+        guint gen;
+        if(lines[0] && sscanf(lines[0], "g %u", &gen) == 1 && gen == generation)
+        {
+            replay(lines);
+            valid = TRUE;
+        }
+        g_strfreev(lines);
+        g_free(buf);
+    }
+
+    if(!valid)
+    {
+        gchar * header = g_strdup_printf("g %u\n", generation);
+        if(!g_file_set_contents(path, header, -1, NULL))
+            g_printerr("%s.\n", _("Couldn't reset playlist journal"));
+        journal_bytes = 0;
+        g_free(header);
+    }
+
+    g_free(path);
+}
+
+void state_playlist_init(void)
+{
+    if(!load_snapshot())
+        load_export();
+
+    load_journal();
+
+    pending = g_string_new("");
+    finished = g_async_queue_new();
+
     GError * error = NULL;
-    pool = g_thread_pool_new(save_playlist_threadfunc, NULL, 1, FALSE, &error);
+    pool = g_thread_pool_new(save_threadfunc, NULL, 1, FALSE, &error);
     if(error)
         g_error("%s (%s).\n", _("Couldn't create thread pool"), error->message);
 }
 
 void state_playlist_destroy(void)
 {
+    // fold everything into the snapshot so the next startup has nothing to
+    // replay
+    if(journal_bytes || pending->len)
+        compact();
+
     g_thread_pool_free(pool, FALSE, TRUE);
-    if(playlist_modified())
-        save_playlist(generate_playlist_data());
+    if(journal_fd != -1)
+        while(close(journal_fd) == -1 && errno == EINTR);
+
+    reap_finished();
+    g_async_queue_unref(finished);
+    g_string_free(pending, TRUE);
 }
 
 void state_playlist_launch_save_if_time_has_come(void)
 {
-    if(!playlist_flush_due())
+    reap_finished();
+
+    if(!pending->len)
         return;
 
-    if(g_thread_pool_unprocessed(pool))
+    if(journal_bytes + pending->len >= journal_compact_min &&
+       journal_bytes + pending->len >= snapshot_bytes / 2)
     {
-        g_warning(_("Thread pool is getting backed up!  Attempts to save playlist are hanging?"));
+        compact();
         return;
     }
 
-    GError * error = NULL;
-    g_thread_pool_push(pool, generate_playlist_data(), &error);
-    if(error)
-        g_error("%s (%s).\n", _("Couldn't push thread to save playlist to disk"), error->message);
-
-    playlist_mark_as_flushed();
+    SaveJob * job = g_new0(SaveJob, 1);
+    job->kind = JOB_APPEND;
+    job->records = pending;
+    journal_bytes += pending->len;
+    pending = g_string_new("");
+    push_job(job);
 }
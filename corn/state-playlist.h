@@ -7,4 +7,10 @@ void state_playlist_init(void);
 void state_playlist_destroy(void);
 void state_playlist_launch_save_if_time_has_come(void);
 
+void state_playlist_log_append(const gchar * uri);
+void state_playlist_log_remove(gint track);
+void state_playlist_log_move(gint start, gint count, gint dest);
+void state_playlist_log_replace(gint track, const gchar * uri);
+void state_playlist_log_clear(void);
+
 #endif
@@ -16,6 +16,7 @@
 gboolean setting_loop_at_end;
 gboolean setting_random_order;
 gboolean setting_repeat_track;
+gint setting_signal_window;
 
 static void save(const char * name, gint num)
 {
@@ -59,6 +60,11 @@ void state_settings_init(void)
     setting_random_order = load("state.random", 0, 1, 0);
     setting_repeat_track = load("state.repeat", 0, 1, 0);
 
+    // not state, but a knob: how many ms of changes to collect before telling
+    // d-bus about them.  0 sends them at the end of the main loop iteration.
+    // never saved, so it stays whatever was written there by hand.
+    setting_signal_window = load("signal_window", 0, 1000, 0);
+
     playlist_seek(load("state.list_position", -1, playlist_length()-1, -1));
     gint pos = load("state.track_position", 0, G_MAXINT, 0);
 
@@ -6,6 +6,7 @@
 extern gboolean setting_loop_at_end;
 extern gboolean setting_random_order;
 extern gboolean setting_repeat_track;
+extern gint setting_signal_window;
 
 void state_settings_init(void);
 void state_settings_destroy(void);
@@ -7,9 +7,14 @@
 
 #include <stdio.h>
 
+gchar * state_file_path(const char * name)
+{
+    return g_build_filename(g_get_user_data_dir(), main_instance_name, name, NULL);
+}
+
 FILE * state_file_open(const char * name, const char * mode)
 {
-    gchar * path = g_build_filename(g_get_user_data_dir(), main_instance_name, name, NULL);
+    gchar * path = state_file_path(name);
     FILE * f = g_fopen(path, mode);
     g_free(path);
     return f;
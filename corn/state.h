@@ -1,8 +1,10 @@
 #ifndef __corn_state_h__
 #define __corn_state_h__
 
+#include <glib.h>
 #include <stdio.h>
 
+gchar * state_file_path(const char * name);
 FILE * state_file_open(const char * name, const char * mode);
 
 #endif
@@ -0,0 +1,87 @@
+#include "config.h"
+
+#include "uri-intern.h"
+
+#include <glib.h>
+
+#include <string.h>
+
+// each uri lives in a single allocation together with its refcount, so an
+// interned pointer can be turned back into its record without a lookup.
+
+typedef struct
+{
+    guint refs;
+    gsize size; // strlen + 1
+    gchar str[1];
+} InternedUri;
+
+#define record_overhead G_STRUCT_OFFSET(InternedUri, str)
+#define record_of(s) ((InternedUri *)((s) - record_overhead))
+
+static GHashTable * pool = NULL; // str -> its record
+
+// bytes the pool actually holds, and bytes every live reference would take
+// if it had its own copy.  the difference is what interning saves.
+static gsize held_bytes = 0;
+static gsize referenced_bytes = 0;
+
+const gchar * uri_intern(const gchar * uri)
+{
+    g_return_val_if_fail(uri != NULL, NULL);
+
+    if(!pool)
+        pool = g_hash_table_new(g_str_hash, g_str_equal);
+
+    InternedUri * rec = g_hash_table_lookup(pool, uri);
+    if(!rec)
+    {
+        gsize size = strlen(uri) + 1;
+        rec = g_malloc(record_overhead + size);
+        rec->refs = 0;
+        rec->size = size;
+        memcpy(rec->str, uri, size);
+        g_hash_table_insert(pool, rec->str, rec);
+        held_bytes += record_overhead + size;
+    }
+
+    rec->refs++;
+    referenced_bytes += rec->size;
+    return rec->str;
+}
+
+const gchar * uri_ref(const gchar * interned)
+{
+    InternedUri * rec = record_of(interned);
+    rec->refs++;
+    referenced_bytes += rec->size;
+    return interned;
+}
+
+void uri_unref(const gchar * interned)
+{
+    if(!interned)
+        return;
+
+    InternedUri * rec = record_of(interned);
+    referenced_bytes -= rec->size;
+    if(--rec->refs)
+        return;
+
+    g_hash_table_remove(pool, rec->str);
+    held_bytes -= record_overhead + rec->size;
+    g_free(rec);
+}
+
+// the interned copy of uri if there is one, without taking a reference
+const gchar * uri_lookup(const gchar * uri)
+{
+    InternedUri * rec = pool ? g_hash_table_lookup(pool, uri) : NULL;
+    return rec ? rec->str : NULL;
+}
+
+void uri_intern_stats(gsize * held, gssize * saved)
+{
+    *held = held_bytes;
+    *saved = (gssize)referenced_bytes - (gssize)held_bytes;
+}
@@ -0,0 +1,16 @@
+#ifndef __corn_uri_intern_h__
+#define __corn_uri_intern_h__
+
+#include <glib.h>
+
+// one shared, refcounted copy of each uri for the playlist, the db scheduler
+// and the watcher.  main thread only.
+
+const gchar * uri_intern(const gchar * uri);
+const gchar * uri_ref(const gchar * interned);
+void uri_unref(const gchar * interned);
+const gchar * uri_lookup(const gchar * uri);
+
+void uri_intern_stats(gsize * held, gssize * saved);
+
+#endif
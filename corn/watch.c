@@ -2,119 +2,595 @@
 #include "playlist.h"
 #include "music-metadata.h"
 #include "db.h"
+#include "event-channel.h"
 
 #include <gio/gio.h>
 #include <glib.h>
 
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
 #include <string.h>
 
-static GQueue event_queue = G_QUEUE_INIT;
-static GHashTable * watches = NULL;
+// every watched directory shares a single inotify instance.  a reader thread
+// pulls events off it and hands them to the main loop over an event channel;
+// everything else, including the wd -> path table, belongs to the main loop.
 
+#define watch_mask (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+#define watch_ring_size 1024
+
+// directories rescanned per idle call after events have been lost
+#define rescan_batch_size 16
+
+// a file counts as settled once nothing has happened to it for
+// settle_window ms since it was closed after writing (or deleted, or renamed),
+// or for settle_timeout ms if it never was
+#define settle_window 500
+#define settle_timeout 5000
+#define settled_mask (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+// how long the reader waits before trying again to report lost events when
+// the ring is full, in ms
+#define watch_retry_interval 100
+
+typedef struct
+{
+    gint wd;
+    guint32 mask;
+    gchar * name; // NULL for events about the watched directory itself
+} WatchEvent;
+
+static gboolean watch_failed = FALSE;
+static gint inotify_fd = -1;
+static gint stop_fd = -1;
+static GThread * reader = NULL;
+static EventChannel * channel = NULL;
+static EventRing * ring = NULL;
+
+// wds are small and handed out in increasing order, so the table from wd to
+// path is just an array.  the paths themselves belong to `watched', which
+// maps them back to their wd.
+static GPtrArray * paths = NULL;
+static GHashTable * watched = NULL;
+static gboolean watch_limit_warned = FALSE;
+
+static GQueue rescan_queue = G_QUEUE_INIT; // of paths
+static guint rescan_source = 0;
+static GHashTable * rescan_tracks = NULL; // directory -> GSList of playlist tracks in it
+
+// files that have changed but haven't settled yet
 typedef struct
 {
-    GFileMonitor * monitor;
-} DirWatch;
+    guint32 mask; // everything that's happened to it
+    gint64 last;  // when the last of it happened, in ms
+} PendingChange;
+
+static GHashTable * pending = NULL; // path -> PendingChange
+static guint settle_source = 0;
+
+// reader thread
 
-static void watch_free(gpointer data)
+static gboolean push(gint wd, guint32 mask, const gchar * name)
 {
-    DirWatch * watch = (DirWatch *)data;
-    g_file_monitor_cancel(watch->monitor);
-    g_object_unref(watch->monitor);
-    g_free(watch);
+    WatchEvent * ev = g_new(WatchEvent, 1);
+    ev->wd = wd;
+    ev->mask = mask;
+    ev->name = g_strdup(name);
+    if(event_ring_push(ring, ev))
+        return TRUE;
+
+    g_free(ev->name);
+    g_free(ev);
+    return FALSE;
 }
 
-static gint locate(const gchar * path)
+static gpointer reader_threadfunc(G_GNUC_UNUSED gpointer data)
 {
-    for(gint i = 0; i < playlist_length(); i++)
-        if(!strcmp(path, playlist_nth(i)))
-            return i;
-    return -1;
+    gchar buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = { { inotify_fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+
+    // events dropped because the ring was full are as lost as if the
+    // kernel's own queue had overflowed, so they get reported the same way
+    gboolean lost = FALSE;
+
+    for(;;)
+    {
+        gint ready = poll(fds, 2, lost ? watch_retry_interval : -1);
+        if(ready == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(fds[1].revents)
+            break;
+        if(lost)
+            lost = !push(-1, IN_Q_OVERFLOW, NULL);
+        if(!ready || !(fds[0].revents & POLLIN))
+            continue;
+
+        gssize len = read(inotify_fd, buf, sizeof(buf));
+        if(len == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(len <= 0)
+            break;
+
+        for(gchar * p = buf; p < buf + len; )
+        {
+            struct inotify_event * ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if(!lost && !push(ev->wd, ev->mask, ev->len ? ev->name : NULL))
+                lost = TRUE;
+        }
+    }
+
+    return NULL;
+}
+
+// the watch table
+
+static gboolean add_watch(const gchar * path)
+{
+    if(g_hash_table_lookup(watched, path))
+        return FALSE;
+
+    gint wd = inotify_add_watch(inotify_fd, path, watch_mask);
+    if(wd == -1)
+    {
+        if(errno != ENOSPC)
+            g_printerr("Unable to monitor directory %s (%s).\n", path, g_strerror(errno));
+        else if(!watch_limit_warned)
+        {
+            g_printerr("Unable to monitor directory %s and any more after it "
+                       "(raise fs.inotify.max_user_watches to watch them all).\n", path);
+            watch_limit_warned = TRUE;
+        }
+        return FALSE;
+    }
+
+    if((guint)wd >= paths->len)
+        g_ptr_array_set_size(paths, wd + 1);
+    // the same directory under another name gets the same wd back.  that's
+    // usually because it was renamed, so the newest name wins and the old one
+    // is no longer watched.
+    const gchar * old = g_ptr_array_index(paths, wd);
+    if(old)
+        g_hash_table_remove(watched, old);
+
+    gchar * copy = g_strdup(path);
+    g_hash_table_insert(watched, copy, GINT_TO_POINTER(wd));
+    g_ptr_array_index(paths, wd) = copy;
+    g_debug("Monitor directory %s", path);
+    return TRUE;
+}
+
+static const gchar * path_of(gint wd)
+{
+    return wd > 0 && (guint)wd < paths->len ? g_ptr_array_index(paths, wd) : NULL;
+}
+
+// the kernel dropped the watch, because the directory is gone or unmounted
+static void forget_watch(gint wd)
+{
+    const gchar * path = path_of(wd);
+    if(!path)
+        return;
+    g_ptr_array_index(paths, wd) = NULL;
+    g_hash_table_remove(watched, path);
+}
+
+static gboolean is_hidden(const gchar * name)
+{
+    return name[0] == '.';
+}
+
+// main loop
+
+static gint64 now_ms(void)
+{
+    GTimeVal now;
+    g_get_current_time(&now);
+    return (gint64)now.tv_sec * 1000 + now.tv_usec / 1000;
 }
 
-gboolean handle_event_when_idle(G_GNUC_UNUSED gpointer data)
+// applies a set of settled files in one go: tracks whose files are gone are
+// removed together, changed tracks go to the db (which only probes them
+// again if their fingerprint changed), and new files are added as a single
+// background scan, which sniffs out whatever isn't music.
+static void apply_changes(GPtrArray * settled)
 {
-    GFile * file = g_queue_pop_head(&event_queue);
-    gchar * uri = g_file_get_uri(file);
-    g_object_unref(file);
-    if(uri)
+    GArray * gone = g_array_new(FALSE, FALSE, sizeof(gint));
+    GPtrArray * added = g_ptr_array_new();
+    guint nchanged = 0;
+
+    for(guint i = 0; i < settled->len; i++)
     {
-        gint pos = locate(uri);
-        GHashTable * meta = db_get_noadd(uri);
-        gboolean has_meta = g_hash_table_size(meta);
-        if(pos > -1)
+        const gchar * path = g_ptr_array_index(settled, i);
+        gchar * uri = g_filename_to_uri(path, NULL, NULL);
+        if(!uri)
+            continue;
+
+        gint pos = playlist_locate(uri);
+        gboolean exists = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+        if(pos > -1 && !exists)
+            playlist_locate_all(uri, gone); // every copy of it
+        else if(pos > -1)
         {
-            if(!has_meta)
-                playlist_remove(pos);
             db_schedule_update(uri);
-            g_free(uri);
+            nchanged++;
         }
-        else if(has_meta)
-            playlist_append(uri);
-    }
-    return !g_queue_is_empty(&event_queue);
-}
-
-void changed_callback(G_GNUC_UNUSED GFileMonitor * monitor,
-                                    GFile * file,
-                      G_GNUC_UNUSED GFile * other_file,
-                                    GFileMonitorEvent event_type,
-                      G_GNUC_UNUSED gpointer user_data)
-{
-    gchar * path = g_file_get_path(file);
-    if(event_type == G_FILE_MONITOR_EVENT_CHANGED) g_message("file : %-40s %s", "G_FILE_MONITOR_EVENT_CHANGED", path);
-    if(event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT) g_message("file : %-40s %s", "G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT", path);
-    if(event_type == G_FILE_MONITOR_EVENT_DELETED) g_message("file : %-40s %s", "G_FILE_MONITOR_EVENT_DELETED", path);
-    if(event_type == G_FILE_MONITOR_EVENT_CREATED) g_message("file : %-40s %s", "G_FILE_MONITOR_EVENT_CREATED", path);
-    if(event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED) g_message("file : %-40s %s", "G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED", path);
-    if(event_type == G_FILE_MONITOR_EVENT_PRE_UNMOUNT) g_message("file : %-40s %s", "G_FILE_MONITOR_EVENT_PRE_UNMOUNT", path);
-    if(event_type == G_FILE_MONITOR_EVENT_UNMOUNTED) g_message("file : %-40s %s", "G_FILE_MONITOR_EVENT_UNMOUNTED", path);
-    g_free(path);
+        else if(exists)
+        {
+            g_ptr_array_add(added, uri);
+            uri = NULL;
+        }
+        g_free(uri);
+    }
+
+    g_debug("File changes settled: %u changed, %u gone, %u new.",
+            nchanged, gone->len, added->len);
 
-    switch(event_type)
+    if(gone->len)
+        playlist_remove_many((const gint *)gone->data, gone->len);
+    g_array_free(gone, TRUE);
+
+    if(added->len)
     {
-        case G_FILE_MONITOR_EVENT_CHANGED:
-        case G_FILE_MONITOR_EVENT_DELETED:
-        case G_FILE_MONITOR_EVENT_CREATED:
-        case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
-            if(g_queue_is_empty(&event_queue) ||
-               !g_file_equal((GFile *)g_queue_peek_tail(&event_queue), file))
-            {
-                g_object_ref(file);
-                g_queue_push_tail(&event_queue, file);
-                if(g_queue_get_length(&event_queue) == 1)
-                    g_idle_add(handle_event_when_idle, NULL);
-            }
-        default:
-            return;
+        g_ptr_array_add(added, NULL);
+        playlist_append_many_async((gchar **)g_ptr_array_free(added, FALSE));
     }
+    else
+        g_ptr_array_free(added, TRUE);
 }
 
-void watch_dir(const gchar * uri)
+static gboolean settle_func(G_GNUC_UNUSED gpointer data)
+{
+    gint64 now = now_ms();
+    GPtrArray * settled = g_ptr_array_new();
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, pending);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+    {
+        PendingChange * change = (PendingChange *)value;
+        gint64 quiet = now - change->last;
+        if((change->mask & settled_mask && quiet >= settle_window) || quiet >= settle_timeout)
+        {
+            g_hash_table_iter_steal(&iter);
+            g_ptr_array_add(settled, key);
+            g_free(change);
+        }
+    }
+
+    if(settled->len)
+        apply_changes(settled);
+    for(guint i = 0; i < settled->len; i++)
+        g_free(g_ptr_array_index(settled, i));
+    g_ptr_array_free(settled, TRUE);
+
+    if(g_hash_table_size(pending))
+        return TRUE;
+    settle_source = 0;
+    return FALSE;
+}
+
+// the first event for a file starts a window, and every one after that just
+// adds to it, so a file being copied in costs the same as a file being touched
+static void queue_change(const gchar * path, guint32 mask)
+{
+    PendingChange * change = g_hash_table_lookup(pending, path);
+    if(!change)
+    {
+        change = g_new0(PendingChange, 1);
+        g_hash_table_insert(pending, g_strdup(path), change);
+    }
+    change->mask |= mask;
+    change->last = now_ms();
+
+    if(!settle_source)
+        settle_source = g_timeout_add(settle_window, settle_func, NULL);
+}
+
+// watches a directory that has just turned up, and everything under it.
+// whatever is in it already won't be announced by events of its own, so
+// every file found is queued as if it had just been written.
+static void watch_tree(const gchar * path)
+{
+    if(g_hash_table_lookup(watched, path))
+        return;
+    add_watch(path);
+
+    GDir * dir = g_dir_open(path, 0, NULL);
+    if(!dir)
+        return;
+
+    const gchar * name;
+    while((name = g_dir_read_name(dir)))
+    {
+        if(is_hidden(name))
+            continue;
+        gchar * child = g_build_filename(path, name, NULL);
+        if(g_file_test(child, G_FILE_TEST_IS_DIR) && !g_file_test(child, G_FILE_TEST_IS_SYMLINK))
+            watch_tree(child);
+        else if(g_file_test(child, G_FILE_TEST_IS_REGULAR))
+            queue_change(child, IN_CLOSE_WRITE);
+        g_free(child);
+    }
+    g_dir_close(dir);
+}
+
+// a directory that has been moved away takes its tracks with it
+static void forget_tree(const gchar * path)
+{
+    gsize len = strlen(path);
+    for(gint i = 0; i < playlist_length(); i++)
+    {
+        gchar * track = g_filename_from_uri(playlist_nth(i), NULL, NULL);
+        if(track && !strncmp(track, path, len) && track[len] == G_DIR_SEPARATOR)
+            queue_change(track, IN_DELETE);
+        g_free(track);
+    }
+}
+
+// looks over one directory for anything that changed while events were being
+// lost.  every file in it, and every track that was in it but is gone, is
+// queued as if an event had come in for it, so it all settles and gets
+// applied like any other change.  tracks that haven't changed cost only a
+// fingerprint comparison in the db, and directories that appeared get watched.
+static void rescan_dir(const gchar * path)
 {
-    if(!watches)
-        watches = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, watch_free);
+    for(GSList * it = g_hash_table_lookup(rescan_tracks, path); it; it = it->next)
+        if(!g_file_test(it->data, G_FILE_TEST_EXISTS))
+            queue_change(it->data, IN_DELETE);
+
+    GFile * dir = g_file_new_for_path(path);
+    GFileEnumerator * fenum = g_file_enumerate_children(dir,
+            G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
+            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    g_object_unref(dir);
+    if(!fenum)
+        return;
 
-    if(!g_hash_table_lookup(watches, uri))
+    GFileInfo * info;
+    while((info = g_file_enumerator_next_file(fenum, NULL, NULL)))
     {
-        GError * error = NULL;
-        DirWatch * watch = g_new(DirWatch, 1);
-        GFile * f = g_file_new_for_uri(uri);
-        watch->monitor = g_file_monitor_directory(f, G_FILE_MONITOR_NONE, NULL, &error);
-        g_object_unref(f);
-        if(error)
+        const gchar * name = g_file_info_get_attribute_byte_string(info, G_FILE_ATTRIBUTE_STANDARD_NAME);
+        if(is_hidden(name))
         {
-            g_printerr("Unable to monitor directory %s (%s).\n", uri, error->message);
-            g_error_free(error);
-            g_free(watch);
+            g_object_unref(info);
+            continue;
         }
+
+        gchar * child = g_build_filename(path, name, NULL);
+        GFileType type = g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_STANDARD_TYPE);
+        if(type == G_FILE_TYPE_DIRECTORY)
+        {
+            if(!g_hash_table_lookup(watched, child))
+                watch_tree(child);
+        }
+        else if(type == G_FILE_TYPE_REGULAR)
+            queue_change(child, IN_CLOSE_WRITE);
+        g_free(child);
+        g_object_unref(info);
+    }
+    g_object_unref(fenum);
+}
+
+static gboolean rescan_some(G_GNUC_UNUSED gpointer data)
+{
+    gchar * path;
+    for(gint i = 0; i < rescan_batch_size && (path = g_queue_pop_head(&rescan_queue)); i++)
+    {
+        rescan_dir(path);
+        g_free(path);
+    }
+
+    if(g_queue_is_empty(&rescan_queue))
+    {
+        g_debug("Rescan of watched directories done.");
+        g_hash_table_remove_all(rescan_tracks);
+        rescan_source = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void clear_rescan(void)
+{
+    gchar * path;
+    while((path = g_queue_pop_head(&rescan_queue)))
+        g_free(path);
+    if(rescan_tracks)
+        g_hash_table_remove_all(rescan_tracks);
+}
+
+static void free_track_list(gpointer data)
+{
+    for(GSList * it = data; it; it = it->next)
+        g_free(it->data);
+    g_slist_free(data);
+}
+
+// files vanishing leaves nothing to find in their directory, so the playlist
+// is the only place to learn which tracks were there
+static void index_tracks(void)
+{
+    for(gint i = 0; i < playlist_length(); i++)
+    {
+        gchar * track = g_filename_from_uri(playlist_nth(i), NULL, NULL);
+        if(!track)
+            continue;
+
+        gchar * dir = g_path_get_dirname(track);
+        GSList * tracks = g_hash_table_lookup(rescan_tracks, dir);
+        if(!g_hash_table_lookup(watched, dir))
+            g_free(track);
+        else if(tracks)
+            g_slist_insert(tracks, track, 1); // behind the head, which the table points to
         else
         {
-            g_debug("Monitor directory %s", uri);
-            // connect to signal
-            g_signal_connect(watch->monitor, "changed", (gpointer)changed_callback, NULL);
-            g_hash_table_insert(watches, g_strdup(uri), watch);
+            g_hash_table_insert(rescan_tracks, dir, g_slist_prepend(NULL, track));
+            dir = NULL;
         }
+        g_free(dir);
+    }
+}
+
+// events were lost, so there's no telling what changed.  go over every
+// watched directory again, a few at a time so the main loop keeps running.
+static void start_rescan(void)
+{
+    clear_rescan();
+
+    GList * all = g_hash_table_get_keys(watched);
+    for(GList * it = all; it; it = g_list_next(it))
+        g_queue_push_tail(&rescan_queue, g_strdup(it->data));
+    g_list_free(all);
+    index_tracks();
+
+    g_message("Lost track of file changes, rescanning %u directories.",
+              g_queue_get_length(&rescan_queue));
+
+    if(!rescan_source)
+        rescan_source = g_idle_add_full(G_PRIORITY_LOW, rescan_some, NULL, NULL);
+}
+
+static void handle_event(gpointer item, G_GNUC_UNUSED gpointer data)
+{
+    WatchEvent * ev = (WatchEvent *)item;
+    const gchar * dir = path_of(ev->wd);
+
+    if(ev->mask & IN_Q_OVERFLOW)
+        start_rescan();
+    else if(ev->mask & IN_IGNORED)
+        forget_watch(ev->wd);
+    else if(dir && ev->name && !is_hidden(ev->name)) // rsync's temporaries, for one
+    {
+        gchar * path = g_build_filename(dir, ev->name, NULL);
+        if(!(ev->mask & IN_ISDIR))
+            queue_change(path, ev->mask);
+        else if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+            watch_tree(path);
+        else if(ev->mask & IN_MOVED_FROM)
+            forget_tree(path);
+        g_free(path);
+    }
+
+    g_free(ev->name);
+    g_free(ev);
+}
+
+static void free_event(gpointer item)
+{
+    WatchEvent * ev = (WatchEvent *)item;
+    g_free(ev->name);
+    g_free(ev);
+}
+
+static gboolean watch_init(void)
+{
+    if(inotify_fd != -1)
+        return TRUE;
+    if(watch_failed)
+        return FALSE;
+
+    if((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ||
+       (stop_fd = eventfd(0, EFD_CLOEXEC)) == -1 ||
+       !(channel = event_channel_new(handle_event, NULL, free_event, NULL)))
+    {
+        g_printerr("Unable to monitor directories (%s).\n", g_strerror(errno));
+        watch_failed = TRUE;
+        watch_destroy();
+        return FALSE;
+    }
+
+    ring = event_channel_add_ring(channel, watch_ring_size);
+    paths = g_ptr_array_new();
+    watched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    rescan_tracks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_track_list);
+
+    GError * error = NULL;
+    if(!(reader = g_thread_create(reader_threadfunc, NULL, TRUE, &error)))
+    {
+        g_printerr("Unable to monitor directories (%s).\n", error->message);
+        g_error_free(error);
+        watch_failed = TRUE;
+        watch_destroy();
+        return FALSE;
     }
+
+    return TRUE;
+}
+
+void watch_destroy(void)
+{
+    if(reader)
+    {
+        guint64 one = 1;
+        while(write(stop_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+        g_thread_join(reader);
+        reader = NULL;
+    }
+
+    if(rescan_source)
+        g_source_remove(rescan_source);
+    rescan_source = 0;
+    clear_rescan();
+    if(rescan_tracks)
+        g_hash_table_unref(rescan_tracks);
+    rescan_tracks = NULL;
+
+    // whatever hasn't settled by now gets caught by the fingerprint check on
+    // the next startup
+    if(settle_source)
+        g_source_remove(settle_source);
+    settle_source = 0;
+    if(pending)
+        g_hash_table_unref(pending);
+    pending = NULL;
+
+    if(channel)
+    {
+        guint max_depth, ndropped, ncoalesced;
+        event_channel_stats(channel, &max_depth, &ndropped, &ncoalesced);
+        g_debug("Watch events: %u deepest backlog, %u dropped.", max_depth, ndropped);
+        event_channel_destroy(channel);
+    }
+    channel = NULL;
+    ring = NULL;
+
+    if(inotify_fd != -1)
+        close(inotify_fd);
+    if(stop_fd != -1)
+        close(stop_fd);
+    inotify_fd = stop_fd = -1;
+
+    if(paths)
+        g_ptr_array_free(paths, TRUE);
+    if(watched)
+        g_hash_table_unref(watched);
+    paths = NULL;
+    watched = NULL;
 }
 
+void watch_dir(const gchar * uri)
+{
+    // inotify only knows about local files
+    gchar * path = g_filename_from_uri(uri, NULL, NULL);
+    if(!path)
+    {
+        g_debug("Not monitoring non-local directory %s", uri);
+        return;
+    }
+
+    if(watch_init())
+        add_watch(path);
+    g_free(path);
+}
@@ -5,5 +5,6 @@
 #include <glib.h>
 
 void watch_dir(const gchar * uri);
+void watch_destroy(void);
 
 #endif